@@ -0,0 +1,2631 @@
+/*
+ * huffcmd: character-level and whole-command Huffman codes for the CAN
+ * command set, with adaptive and hot-swapped tables, resynchronizing command
+ * streams and parallel byte archives. Interface in huffcmd.h.
+ */
+
+#define _POSIX_C_SOURCE 200809L /* mmap, posix_madvise */
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "huffcmd.h"
+
+/* largest alphabet any builder handles */
+#define MAX_SYMBOLS (MAX_COMMANDS > NUM_CHARS ? MAX_COMMANDS : NUM_CHARS)
+#define MAX_HEAP (MAX_SYMBOLS * 2)
+#define HASH_MAX_SEED 0xFFFF /* displacement search limit per bucket */
+#define STREAM_MAGIC "HCS2"
+#define STREAM_SYNC "\xA5\x5A\xC3\x3C" /* starts every stream block */
+#define STREAM_BLOCK_HEAD 16 /* sync, sequence, count, size, CRC-32 */
+#define STREAM_BLOCK_MAX (STREAM_BLOCK_HEAD + STREAM_BLOCK * 4)
+#define STREAM_TEXT (STREAM_BLOCK * (PROFILE_LINE + 1)) /* names per block */
+#define ARCHIVE_MAGIC "HCA3"
+/* magic, 8-byte original size, 4-byte block size, one 4-bit code length per
+ * byte value */
+#define ARCHIVE_HEADER (4 + 8 + 4 + NUM_CHARS / 2)
+#define ARCHIVE_MAX_BLOCK (1 << 26) /* largest block a decoder accepts */
+#define ARCHIVE_STREAMS 4 /* interleaved streams per block */
+#define ARCHIVE_JUMP (4 * (ARCHIVE_STREAMS - 1)) /* stream size table */
+#define ARCHIVE_PER_REFILL 3 /* codes decoded per stream per refill */
+#define HIST_TABLES 8         /* sub-histograms in count_byte_freq() */
+#define HIST_CHUNK (1u << 30) /* bytes per 32-bit sub-histogram pass */
+
+/* Shortened command strings (for encoding). See COMMENTS[] for full meaning. */
+const char *const COMMANDS[] = {
+    "Pltog",  "Plstat", "Plmode",  "Pltarg", "Plkwlm", "Plinit", "Pltqcm",
+    "Plclmp", "LcKp",   "lcKi",    "lcKd",   "lcpid",  "lcSRT",  "lcLcTog",
+    "lcCSR",  "lcCVD",  "lcTVD",   "lcLTq",  "lcITq",  "lck",    "lcMTq",
+    "lcPTq",  "lcUF",   "lcmode",  "lcSt",   "lcPh",   "efTog",  "efEBk",
+    "efLpCt", "efCOk",  "efTS_s",  "efTC_s", "efESk",  "efESs",  "efLEk",
+    "efTLk",  "efFLp",  "rgRgTog", "rgMd",   "rgApTq", "rgBTN",  "rgRTq",
+    "rgTLD",  "rgTZPD", "rgPBM",   "rgPAC",  "rgPdMu", "rgTk"};
+
+/* Comment for each command: full name or description (same index as
+ * COMMANDS[]). */
+const char *const COMMENTS[] = {
+    "Power limit toggle",
+    "Power limit status",
+    "Power limit mode",
+    "Power limit target",
+    "Power limit kW limit",
+    "Power limit init",
+    "Power limit torque command",
+    "Power limit clamp",
+    "Launch control Kp",
+    "Launch control Ki",
+    "Launch control Kd",
+    "Launch control PID",
+    "Launch control slip ratio target",
+    "Launch control LC toggle",
+    "Launch control current slip ratio",
+    "Launch control current velocity difference",
+    "Launch control target velocity difference",
+    "Launch control LC torque command",
+    "Launch control initial torque",
+    "Launch control k",
+    "Launch control max torque",
+    "Launch control previous torque",
+    "Launch control use filter",
+    "Launch control mode",
+    "Launch control state",
+    "Launch control phase",
+    "Efficiency efficiency toggle",
+    "Efficiency energy budget kWh (efEBk)",
+    "Efficiency lap counter",
+    "Efficiency carry over energy kWh (efCOk)",
+    "Efficiency time eff in straights (s)",
+    "Efficiency time eff in corners (s)",
+    "Efficiency energy spent in corners kWh (efESk)",
+    "Efficiency energy spent in straights kWh (efESs)",
+    "Efficiency lap energy spent kWh (efLEk)",
+    "Efficiency total lap distance km (efTLk)",
+    "Efficiency finished lap",
+    "Regen regen toggle",
+    "Regen mode",
+    "Regen APPS torque",
+    "Regen BPS torque Nm",
+    "Regen regen torque command",
+    "Regen torque limit D Nm",
+    "Regen torque at zero pedal D Nm",
+    "Regen percent BPS for max regen",
+    "Regen percent APPS for coasting",
+    "Regen pad mu",
+    "Regen tick"};
+
+/* Value type for each command, from the units in COMMENTS[] (same index as
+ * COMMANDS[]) */
+const ValueType VALUE_TYPES[] = {
+    {VALUE_BOOL, 0, ""},           /* Pltog */
+    {VALUE_ENUM8, 0, ""},          /* Plstat */
+    {VALUE_ENUM8, 0, ""},          /* Plmode */
+    {VALUE_FIXED16, 0.01, "kW"},   /* Pltarg */
+    {VALUE_FIXED16, 0.01, "kW"},   /* Plkwlm */
+    {VALUE_BOOL, 0, ""},           /* Plinit */
+    {VALUE_FIXED16, 0.1, "Nm"},    /* Pltqcm */
+    {VALUE_FIXED16, 0.1, "Nm"},    /* Plclmp */
+    {VALUE_FLOAT16, 0, ""},        /* LcKp */
+    {VALUE_FLOAT16, 0, ""},        /* lcKi */
+    {VALUE_FLOAT16, 0, ""},        /* lcKd */
+    {VALUE_FLOAT16, 0, ""},        /* lcpid */
+    {VALUE_FIXED16, 0.0001, ""},   /* lcSRT */
+    {VALUE_BOOL, 0, ""},           /* lcLcTog */
+    {VALUE_FIXED16, 0.0001, ""},   /* lcCSR */
+    {VALUE_FIXED16, 0.01, "m/s"},  /* lcCVD */
+    {VALUE_FIXED16, 0.01, "m/s"},  /* lcTVD */
+    {VALUE_FIXED16, 0.1, "Nm"},    /* lcLTq */
+    {VALUE_FIXED16, 0.1, "Nm"},    /* lcITq */
+    {VALUE_FLOAT16, 0, ""},        /* lck */
+    {VALUE_FIXED16, 0.1, "Nm"},    /* lcMTq */
+    {VALUE_FIXED16, 0.1, "Nm"},    /* lcPTq */
+    {VALUE_BOOL, 0, ""},           /* lcUF */
+    {VALUE_ENUM8, 0, ""},          /* lcmode */
+    {VALUE_ENUM8, 0, ""},          /* lcSt */
+    {VALUE_ENUM8, 0, ""},          /* lcPh */
+    {VALUE_BOOL, 0, ""},           /* efTog */
+    {VALUE_FIXED16, 0.001, "kWh"}, /* efEBk */
+    {VALUE_INT16, 0, ""},          /* efLpCt */
+    {VALUE_FIXED16, 0.001, "kWh"}, /* efCOk */
+    {VALUE_FIXED16, 0.01, "s"},    /* efTS_s */
+    {VALUE_FIXED16, 0.01, "s"},    /* efTC_s */
+    {VALUE_FIXED16, 0.001, "kWh"}, /* efESk */
+    {VALUE_FIXED16, 0.001, "kWh"}, /* efESs */
+    {VALUE_FIXED16, 0.001, "kWh"}, /* efLEk */
+    {VALUE_FIXED16, 0.001, "km"},  /* efTLk */
+    {VALUE_BOOL, 0, ""},           /* efFLp */
+    {VALUE_BOOL, 0, ""},           /* rgRgTog */
+    {VALUE_ENUM8, 0, ""},          /* rgMd */
+    {VALUE_FIXED16, 0.1, "Nm"},    /* rgApTq */
+    {VALUE_FIXED16, 0.1, "Nm"},    /* rgBTN */
+    {VALUE_FIXED16, 0.1, "Nm"},    /* rgRTq */
+    {VALUE_FIXED16, 0.1, "Nm"},    /* rgTLD */
+    {VALUE_FIXED16, 0.1, "Nm"},    /* rgTZPD */
+    {VALUE_FIXED16, 0.01, "%"},    /* rgPBM */
+    {VALUE_FIXED16, 0.01, "%"},    /* rgPAC */
+    {VALUE_FLOAT16, 0, ""},        /* rgPdMu */
+    {VALUE_INT16, 0, ""}};         /* rgTk */
+
+/* Matched ignoring case by find_subsystem() */
+const Subsystem SUBSYSTEMS[] = {{"Pl", "Power limit"},
+                                 {"lc", "Launch control"},
+                                 {"ef", "Efficiency"},
+                                 {"rg", "Regen"}};
+
+/* The tables above are sized by their initializers; a mismatch with the
+ * counts in huffcmd.h fails to compile (negative array size) */
+#define COUNT_OF(a) (sizeof(a) / sizeof((a)[0]))
+typedef char commands_count[COUNT_OF(COMMANDS) == NUM_COMMANDS ? 1 : -1];
+typedef char comments_count[COUNT_OF(COMMENTS) == NUM_COMMANDS ? 1 : -1];
+typedef char value_types_count[COUNT_OF(VALUE_TYPES) == NUM_COMMANDS ? 1
+                                                                      : -1];
+typedef char subsystems_count[COUNT_OF(SUBSYSTEMS) == NUM_SUBSYSTEMS ? 1
+                                                                     : -1];
+
+/* Tree node in the node arena; children are arena indices, -1 for none */
+typedef struct {
+  int symbol; /* character (0..255), or -1 for internal */
+  unsigned long freq;
+  int left, right;
+} Node;
+
+#ifdef HUFF_STATS
+HuffStats huff_stats;
+/* Relaxed atomic adds: any coding path may run on several threads at once,
+ * and the totals only need to be exact, not ordered */
+#define STAT_ADD(field, n)                                                     \
+  ((void)__atomic_fetch_add(&huff_stats.field, (unsigned long)(n),             \
+                            __ATOMIC_RELAXED))
+#define STAT_DECODE(len)                                                       \
+  (STAT_ADD(lookups, 1),                                                       \
+   STAT_ADD(secondary_lookups, (len) > DECODE_ROOT_BITS),                      \
+   STAT_ADD(bits_in, len))
+#else
+#define STAT_ADD(field, n) ((void)0)
+#define STAT_DECODE(len) ((void)0)
+#endif
+
+/* Tree construction state, one per build so builds are reentrant. Fixed node
+ * arena: n leaves and n - 1 internal nodes, so a rebuild never touches the
+ * allocator. The heap orders arena indices by frequency. */
+typedef struct {
+  Node nodes[2 * MAX_SYMBOLS];
+  int n_nodes;
+  int heap[MAX_HEAP];
+  int heap_size;
+} TreeBuilder;
+
+static void heap_swap(TreeBuilder *tb, int i, int j) {
+  int t = tb->heap[i];
+  tb->heap[i] = tb->heap[j];
+  tb->heap[j] = t;
+}
+
+/* Frequency of the node at heap position i */
+static unsigned long heap_freq(const TreeBuilder *tb, int i) {
+  return tb->nodes[tb->heap[i]].freq;
+}
+
+static void heap_up(TreeBuilder *tb, int i) {
+  while (i > 0) {
+    int p = (i - 1) / 2;
+    if (heap_freq(tb, p) <= heap_freq(tb, i))
+      break;
+    heap_swap(tb, p, i);
+    i = p;
+  }
+}
+
+static void heap_down(TreeBuilder *tb, int i) {
+  for (;;) {
+    int l = 2 * i + 1, r = 2 * i + 2, smallest = i;
+    if (l < tb->heap_size && heap_freq(tb, l) < heap_freq(tb, smallest))
+      smallest = l;
+    if (r < tb->heap_size && heap_freq(tb, r) < heap_freq(tb, smallest))
+      smallest = r;
+    if (smallest == i)
+      break;
+    heap_swap(tb, i, smallest);
+    i = smallest;
+  }
+}
+
+static void heap_push(TreeBuilder *tb, int n) {
+  tb->heap[tb->heap_size++] = n;
+  heap_up(tb, tb->heap_size - 1);
+}
+
+static int heap_pop(TreeBuilder *tb) {
+  int top = tb->heap[0];
+  tb->heap[0] = tb->heap[--tb->heap_size];
+  if (tb->heap_size > 0)
+    heap_down(tb, 0);
+  return top;
+}
+
+/* Take the next node from the arena */
+static int new_node(TreeBuilder *tb, int symbol, unsigned long freq, int left,
+                    int right) {
+  Node *n = &tb->nodes[tb->n_nodes];
+  n->symbol = symbol;
+  n->freq = freq;
+  n->left = left;
+  n->right = right;
+  return tb->n_nodes++;
+}
+
+/* Start an empty codebook */
+void codebook_init(Codebook *cb, const char *name) {
+  cb->name = name;
+  cb->n_commands = 0;
+  cb->prefix_tokens = 0;
+  cb->hash_n = 0;
+}
+
+/* Append a command with weight 1. Returns its index, or -1 if the codebook
+ * is full. The strings are not copied. */
+int codebook_add(Codebook *cb, const char *command, const char *comment) {
+  int i = cb->n_commands;
+  if (i == MAX_COMMANDS)
+    return -1;
+  cb->commands[i] = command;
+  cb->comments[i] = comment;
+  cb->weight[i] = 1;
+  cb->value_type[i].kind = VALUE_NONE;
+  cb->value_type[i].scale = 0;
+  cb->value_type[i].unit = "";
+  cb->n_commands++;
+  cb->hash_n = 0; /* the name hash no longer covers every command */
+  return i;
+}
+
+/* Subsystem index for a command by prefix, ignoring case, or -1 */
+int find_subsystem(const char *cmd) {
+  int k;
+  for (k = 0; k < NUM_SUBSYSTEMS; k++) {
+    const char *p = SUBSYSTEMS[k].prefix, *q = cmd;
+    while (*p && tolower((unsigned char)*p) == tolower((unsigned char)*q)) {
+      p++;
+      q++;
+    }
+    if (*p == '\0')
+      return k;
+  }
+  return -1;
+}
+
+/* Next code symbol of command cmd at *p, advancing *p; -1 at the end. In
+ * prefix-token mode a command that starts with a subsystem prefix (exact
+ * case) yields that prefix's token first, then the remaining characters. */
+int next_symbol(const Codebook *cb, const char *cmd, const char **p) {
+  if (**p == '\0')
+    return -1;
+  if (*p == cmd && cb->prefix_tokens) {
+    int k;
+    for (k = 0; k < NUM_SUBSYSTEMS; k++) {
+      size_t n = strlen(SUBSYSTEMS[k].prefix);
+      if (strncmp(cmd, SUBSYSTEMS[k].prefix, n) == 0) {
+        *p += n;
+        return PREFIX_SYMBOL(k);
+      }
+    }
+  }
+  return (unsigned char)*(*p)++;
+}
+
+/* Count character frequencies from all command strings */
+void count_char_freq(const Codebook *cb, unsigned long *freq) {
+  int c, i;
+  const char *p;
+  for (c = 0; c < NUM_CODE_SYMBOLS; c++)
+    freq[c] = 0;
+  for (i = 0; i < cb->n_commands; i++) {
+    for (p = cb->commands[i]; (c = next_symbol(cb, cb->commands[i], &p)) >= 0;)
+      freq[c]++;
+  }
+}
+
+/* Reassign codes canonically from their lengths alone: symbols are ordered by
+ * (length, symbol) and each length gets consecutive codes, as in DEFLATE.
+ * Both ends then only need to agree on the lengths. Returns 0, or -1 if the
+ * lengths over-subscribe the code space. */
+static int assign_canonical_codes(CodeEntry *codes, int n_symbols) {
+  int bl_count[MAX_CODE_LEN + 1];
+  unsigned long next_code[MAX_CODE_LEN + 1];
+  unsigned long code = 0;
+  int s, len;
+
+  memset(bl_count, 0, sizeof(bl_count));
+  for (s = 0; s < n_symbols; s++) {
+    if (codes[s].len < 0 || codes[s].len > MAX_CODE_LEN)
+      return -1;
+    bl_count[codes[s].len]++;
+  }
+  bl_count[0] = 0;
+  for (len = 1; len <= MAX_CODE_LEN; len++) {
+    code = (code + bl_count[len - 1]) << 1;
+    next_code[len] = code;
+    if (len < 64 && bl_count[len] > 0 &&
+        code + (unsigned long)bl_count[len] > (1UL << len))
+      return -1;
+  }
+  for (s = 0; s < n_symbols; s++) {
+    if (codes[s].len > 0)
+      codes[s].code = next_code[codes[s].len]++;
+  }
+  return 0;
+}
+
+/* Character frequencies weighted by how often each command is sent: every
+ * character of a command counts its weight times (at least once, so commands
+ * missing from a profile stay encodable) */
+void count_weighted_char_freq(const Codebook *cb, unsigned long *freq) {
+  int c, i;
+  const char *p;
+  for (c = 0; c < NUM_CODE_SYMBOLS; c++)
+    freq[c] = 0;
+  for (i = 0; i < cb->n_commands; i++) {
+    unsigned long w = cb->weight[i] ? cb->weight[i] : 1;
+    for (p = cb->commands[i]; (c = next_symbol(cb, cb->commands[i], &p)) >= 0;)
+      freq[c] += w;
+  }
+}
+
+/* Seeded FNV-1a with a murmur3 finalizer, so nearby seeds give unrelated
+ * hashes */
+static uint32_t hash_name(const char *s, uint32_t seed) {
+  uint32_t h = 2166136261u ^ (seed * 0x9E3779B9u);
+  for (; *s; s++) {
+    h ^= (unsigned char)*s;
+    h *= 16777619u;
+  }
+  h ^= h >> 16;
+  h *= 0x85EBCA6Bu;
+  h ^= h >> 13;
+  h *= 0xC2B2AE35u;
+  h ^= h >> 16;
+  return h;
+}
+
+/* Find a seed per bucket, largest buckets first, that sends all of its names
+ * to distinct free slots. Returns 0, or -1 if some bucket has no such seed
+ * below HASH_MAX_SEED. */
+int build_command_hash(Codebook *cb) {
+  int bucket_of[MAX_COMMANDS], size[MAX_COMMANDS];
+  int n = cb->n_commands, i, b, want;
+
+  cb->hash_n = 0;
+  for (i = 0; i < n; i++) {
+    size[i] = 0;
+    cb->hash_seed[i] = 0;
+    cb->hash_slot[i] = -1;
+  }
+  for (i = 0; i < n; i++) {
+    bucket_of[i] = (int)(hash_name(cb->commands[i], 0) % (uint32_t)n);
+    size[bucket_of[i]]++;
+  }
+  for (want = n; want > 0; want--) {
+    for (b = 0; b < n; b++) {
+      int keys[MAX_COMMANDS], slots[MAX_COMMANDS], k = 0, seed;
+      if (size[b] != want)
+        continue;
+      for (i = 0; i < n; i++) {
+        if (bucket_of[i] == b)
+          keys[k++] = i;
+      }
+      for (seed = 1; seed <= HASH_MAX_SEED; seed++) {
+        int j, m, ok = 1;
+        for (j = 0; j < k && ok; j++) {
+          slots[j] = (int)(hash_name(cb->commands[keys[j]], (uint32_t)seed) %
+                           (uint32_t)n);
+          if (cb->hash_slot[slots[j]] >= 0)
+            ok = 0;
+          for (m = 0; m < j && ok; m++) {
+            if (slots[m] == slots[j])
+              ok = 0;
+          }
+        }
+        if (ok)
+          break;
+      }
+      if (seed > HASH_MAX_SEED)
+        return -1;
+      cb->hash_seed[b] = (unsigned short)seed;
+      for (i = 0; i < k; i++)
+        cb->hash_slot[slots[i]] = (short)keys[i];
+    }
+  }
+  cb->hash_n = n;
+  return 0;
+}
+
+/* Index of a command by its short name, or -1. Two hash passes over the name
+ * and a single strcmp to reject names that are not commands; before
+ * build_command_hash() has covered every command, a linear scan instead. */
+int find_command(const Codebook *cb, const char *name) {
+  uint32_t n = (uint32_t)cb->n_commands;
+  int b, idx;
+  if (n == 0)
+    return -1;
+  if (cb->hash_n != cb->n_commands) {
+    for (idx = 0; idx < cb->n_commands; idx++) {
+      if (strcmp(cb->commands[idx], name) == 0)
+        return idx;
+    }
+    return -1;
+  }
+  b = (int)(hash_name(name, 0) % n);
+  idx = cb->hash_slot[hash_name(name, cb->hash_seed[b]) % n];
+  if (idx < 0 || idx >= cb->n_commands || strcmp(cb->commands[idx], name) != 0)
+    return -1;
+  return idx;
+}
+
+/* Load per-command send statistics into cb->weight[]. By default the file is
+ * a log, one message per line (as in a decoded CAN log): each line counts one
+ * send of the command named by its first field, and any trailing fields,
+ * such as a logged value, are ignored. A file whose first line is the header
+ * "name,rate" (or "name rate") is instead a CSV of send rates or counts, one
+ * "name,rate" line per command, with rates scaled by PROFILE_SCALE. Blank
+ * lines, '#' comments and lines naming unknown commands are skipped. Returns
+ * the number of lines used, or -1 if the file cannot be read. */
+int load_profile(const char *path, Codebook *cb) {
+  char line[PROFILE_LINE];
+  FILE *f = fopen(path, "r");
+  int i, used = 0, skipped = 0, first = 1, rates = 0;
+
+  if (!f)
+    return -1;
+  for (i = 0; i < cb->n_commands; i++)
+    cb->weight[i] = 0;
+  while (fgets(line, sizeof(line), f)) {
+    char *name = line, *end, *rest;
+    int idx;
+    while (*name == ' ' || *name == '\t')
+      name++;
+    if (*name == '\0' || *name == '\n' || *name == '\r' || *name == '#')
+      continue;
+    end = name + strcspn(name, ", \t\r\n");
+    rest = *end ? end + 1 : end;
+    *end = '\0';
+    rest += strspn(rest, ", \t");
+    if (first) {
+      first = 0;
+      if (strcmp(name, "name") == 0 && strncmp(rest, "rate", 4) == 0 &&
+          strspn(rest + 4, " \t\r\n") == strlen(rest + 4)) {
+        rates = 1;
+        continue;
+      }
+    }
+    idx = find_command(cb, name);
+    if (idx < 0) {
+      skipped++;
+      continue;
+    }
+    if (rates) {
+      double rate = strtod(rest, NULL);
+      if (rate > 0)
+        cb->weight[idx] += (unsigned long)(rate * PROFILE_SCALE + 0.5);
+    } else {
+      cb->weight[idx] += PROFILE_SCALE;
+    }
+    used++;
+  }
+  fclose(f);
+  if (skipped > 0)
+    fprintf(stderr, "%s: skipped %d line(s) not naming a command\n", path,
+            skipped);
+  return used;
+}
+
+/* Sort order for leaves by (frequency, symbol) */
+typedef struct {
+  unsigned long freq;
+  int symbol;
+} Leaf;
+
+/* Collect the used symbols as leaves sorted by (frequency, symbol).
+ * LSD radix sort, one byte of frequency per pass; passes stop once the
+ * remaining bytes are zero and are skipped when every key shares the byte.
+ * Leaves start in symbol order and each pass is stable, so ties stay in
+ * symbol order. Returns the number of leaves. */
+static int sort_leaves(const unsigned long *freq, int n_symbols,
+                       Leaf *leaves) {
+  Leaf tmp[MAX_SYMBOLS];
+  unsigned long any = 0;
+  int s, n = 0, shift;
+
+  for (s = 0; s < n_symbols; s++) {
+    if (freq[s] == 0)
+      continue;
+    leaves[n].freq = freq[s];
+    leaves[n].symbol = s;
+    any |= freq[s];
+    n++;
+  }
+  for (shift = 0; shift < (int)(sizeof(any) * 8) && (any >> shift);
+       shift += 8) {
+    int count[257], i;
+    memset(count, 0, sizeof(count));
+    for (i = 0; i < n; i++)
+      count[((leaves[i].freq >> shift) & 0xFF) + 1]++;
+    if (count[((leaves[0].freq >> shift) & 0xFF) + 1] == n)
+      continue;
+    for (i = 1; i < 257; i++)
+      count[i] += count[i - 1];
+    for (i = 0; i < n; i++)
+      tmp[count[(leaves[i].freq >> shift) & 0xFF]++] = leaves[i];
+    memcpy(leaves, tmp, (size_t)n * sizeof(leaves[0]));
+  }
+  return n;
+}
+
+/* Length-limited code construction by package-merge. Level 0 holds the
+ * leaves sorted by weight; each higher level merges the leaves with the
+ * pairwise packages of the level below. Selecting the cheapest 2n-2 items of
+ * the top level and expanding packages back down adds one bit of length to a
+ * symbol per occurrence. Only the item kind (leaf symbol or package) is kept
+ * per level, since the first k items of a level always expand into the first
+ * 2*(packages among them) items of the level below. Codes are then assigned
+ * canonically. Returns the longest code length, or -1 if max_len is outside
+ * 1..MAX_LIMITED_LEN or too short for the number of used symbols. */
+int build_limited_codes(const unsigned long *freq, int n_symbols, int max_len,
+                        CodeEntry *codes) {
+  Leaf leaves[MAX_SYMBOLS];
+  unsigned long weight[2][2 * MAX_SYMBOLS];
+  short kind[MAX_LIMITED_LEN][2 * MAX_SYMBOLS]; /* symbol, or -1 = package */
+  int size[MAX_LIMITED_LEN];
+  int s, n, level, i, longest = 0;
+
+  for (s = 0; s < n_symbols; s++) {
+    codes[s].code = 0;
+    codes[s].len = 0;
+  }
+  n = sort_leaves(freq, n_symbols, leaves);
+  if (max_len < 1 || max_len > MAX_LIMITED_LEN)
+    return -1;
+  if (n == 0)
+    return 0;
+  if (n == 1) {
+    codes[leaves[0].symbol].len = 1;
+    return 1;
+  }
+  if ((1 << max_len) < n)
+    return -1;
+  if (max_len > n - 1)
+    max_len = n - 1; /* no code can be longer anyway */
+
+  for (i = 0; i < n; i++) {
+    weight[0][i] = leaves[i].freq;
+    kind[0][i] = (short)leaves[i].symbol;
+  }
+  size[0] = n;
+  for (level = 1; level < max_len; level++) {
+    const unsigned long *prev = weight[(level - 1) & 1];
+    unsigned long *cur = weight[level & 1];
+    int n_pkg = size[level - 1] / 2, li = 0, pi = 0, k = 0;
+    while (li < n || pi < n_pkg) {
+      unsigned long pw = pi < n_pkg ? prev[2 * pi] + prev[2 * pi + 1] : 0;
+      if (pi == n_pkg || (li < n && leaves[li].freq <= pw)) {
+        cur[k] = leaves[li].freq;
+        kind[level][k++] = (short)leaves[li++].symbol;
+      } else {
+        cur[k] = pw;
+        kind[level][k++] = -1;
+        pi++;
+      }
+    }
+    size[level] = k;
+  }
+
+  /* Expand the cheapest 2n-2 items of the top level back down */
+  {
+    int take = 2 * n - 2;
+    for (level = max_len - 1; level >= 0 && take > 0; level--) {
+      int packages = 0;
+      for (i = 0; i < take; i++) {
+        if (kind[level][i] < 0)
+          packages++;
+        else
+          codes[kind[level][i]].len++;
+      }
+      take = 2 * packages;
+    }
+  }
+  for (s = 0; s < n_symbols; s++) {
+    if (codes[s].len > longest)
+      longest = codes[s].len;
+  }
+  assign_canonical_codes(codes, n_symbols);
+  return longest;
+}
+
+/* Build Huffman tree from the frequencies of n_symbols symbols; assign a code
+ * per symbol with non-zero frequency */
+void build_codes(const unsigned long *freq, int n_symbols, CodeEntry *codes) {
+  TreeBuilder tb;
+  int c, n_used = 0, root;
+  tb.heap_size = 0;
+  tb.n_nodes = 0;
+
+  for (c = 0; c < n_symbols; c++) {
+    codes[c].code = 0;
+    codes[c].len = 0;
+    if (freq[c] == 0)
+      continue;
+    heap_push(&tb, new_node(&tb, c, freq[c], -1, -1));
+    n_used++;
+  }
+
+  if (n_used == 0)
+    return;
+
+  while (tb.heap_size > 1) {
+    int a = heap_pop(&tb);
+    int b = heap_pop(&tb);
+    unsigned long sum = tb.nodes[a].freq + tb.nodes[b].freq;
+    heap_push(&tb, new_node(&tb, -1, sum, a, b));
+  }
+  root = heap_pop(&tb);
+
+  /* DFS: left = 0, right = 1 */
+  typedef struct {
+    int n;
+    unsigned long code;
+    int len;
+  } StackFrame;
+  StackFrame stack[MAX_SYMBOLS + 1]; /* depth-first: at most depth + 1 */
+  int sp = 0, too_long = 0;
+  stack[sp].n = root;
+  stack[sp].code = 0;
+  stack[sp].len = tb.nodes[root].symbol >= 0 ? 1 : 0; /* lone symbol: 1 bit */
+  sp++;
+
+  while (sp > 0) {
+    StackFrame f = stack[--sp];
+    const Node *n = &tb.nodes[f.n];
+    if (n->symbol >= 0) {
+      if (f.len > MAX_CODE_LEN)
+        too_long = 1;
+      codes[n->symbol].code = f.code;
+      codes[n->symbol].len = f.len;
+      continue;
+    }
+    if (n->right >= 0) {
+      stack[sp].n = n->right;
+      stack[sp].code = (f.code << 1) | 1;
+      stack[sp].len = f.len + 1;
+      sp++;
+    }
+    if (n->left >= 0) {
+      stack[sp].n = n->left;
+      stack[sp].code = f.code << 1;
+      stack[sp].len = f.len + 1;
+      sp++;
+    }
+  }
+
+  /* A pathologically skewed alphabet can outgrow the code word: fall back to
+   * the length-limited builder so every code fits */
+  if (too_long)
+    build_limited_codes(freq, n_symbols, CODE_LEN_LIMIT, codes);
+}
+
+/* O(n) construction for sorted leaves: the classic two-queue method. Leaves
+ * enter the arena in sorted order and merged nodes are created in
+ * non-decreasing frequency, so the two smallest nodes are always at the heads
+ * of the leaf run and the internal run; no heap is needed. Code lengths are
+ * node depths, filled top-down from the root (the last node). If a code
+ * would be longer than DECODE_MAX_BITS, which no decode table can hold, the
+ * codes come from the length-limited builder instead. Codes are canonical. */
+void build_codes_sorted(const unsigned long *freq, int n_symbols,
+                        CodeEntry *codes) {
+  TreeBuilder tb;
+  Leaf leaves[MAX_SYMBOLS];
+  int depth[2 * MAX_SYMBOLS];
+  int s, n, i, leaf = 0, internal, too_long = 0;
+
+  for (s = 0; s < n_symbols; s++) {
+    codes[s].code = 0;
+    codes[s].len = 0;
+  }
+  n = sort_leaves(freq, n_symbols, leaves);
+  if (n == 0)
+    return;
+  if (n == 1) {
+    codes[leaves[0].symbol].len = 1;
+    return;
+  }
+
+  tb.n_nodes = 0;
+  for (i = 0; i < n; i++)
+    new_node(&tb, leaves[i].symbol, leaves[i].freq, -1, -1);
+  internal = n;
+  for (i = 0; i < n - 1; i++) {
+    int pick[2], k;
+    for (k = 0; k < 2; k++) {
+      if (leaf < n && (internal == tb.n_nodes ||
+                       tb.nodes[leaf].freq <= tb.nodes[internal].freq))
+        pick[k] = leaf++;
+      else
+        pick[k] = internal++;
+    }
+    new_node(&tb, -1, tb.nodes[pick[0]].freq + tb.nodes[pick[1]].freq, pick[0],
+             pick[1]);
+  }
+
+  depth[tb.n_nodes - 1] = 0;
+  for (i = tb.n_nodes - 1; i >= n; i--) {
+    depth[tb.nodes[i].left] = depth[i] + 1;
+    depth[tb.nodes[i].right] = depth[i] + 1;
+  }
+  for (i = 0; i < n; i++) {
+    if (depth[i] > DECODE_MAX_BITS)
+      too_long = 1;
+    codes[tb.nodes[i].symbol].len = depth[i];
+  }
+  if (too_long)
+    build_limited_codes(freq, n_symbols, CODE_LEN_LIMIT, codes);
+  else
+    assign_canonical_codes(codes, n_symbols);
+}
+
+/* Whole-command mode: every command index is one symbol, weighted by
+ * cb->weight[] (e.g. send counts). A weight of 0 is treated as 1 so every
+ * command stays encodable. Codes come from the O(n) builder, or from the
+ * length-limited one when a skewed profile makes a code longer than
+ * COMMAND_LEN_LIMIT, so they always fit the decode table. Codes are
+ * canonical. */
+static void build_command_codes(Codebook *cb) {
+  unsigned long w[MAX_COMMANDS];
+  int i, longest = 0;
+  for (i = 0; i < cb->n_commands; i++)
+    w[i] = cb->weight[i] ? cb->weight[i] : 1;
+  build_codes_sorted(w, cb->n_commands, cb->command_codes);
+  for (i = 0; i < cb->n_commands; i++) {
+    if (cb->command_codes[i].len > longest)
+      longest = cb->command_codes[i].len;
+  }
+  if (longest > COMMAND_LEN_LIMIT)
+    build_limited_codes(w, cb->n_commands, COMMAND_LEN_LIMIT,
+                        cb->command_codes);
+}
+
+/* Serialize the code lengths of an n_symbols alphabet: byte 0 is the
+ * longest length L, bytes 1..L count the symbols of each length, and the used
+ * symbols follow in canonical order, one byte each (two, big-endian, for
+ * alphabets over 256 symbols). Returns the number of bytes written, or -1 if
+ * buf is too small or a single length holds more than 255 symbols. */
+int serialize_code_lengths(const CodeEntry *codes, int n_symbols,
+                           unsigned char *buf, size_t cap) {
+  int count[MAX_CODE_LEN + 1];
+  int c, len, max_len = 0, wide = n_symbols > NUM_CHARS;
+  size_t pos;
+
+  memset(count, 0, sizeof(count));
+  for (c = 0; c < n_symbols; c++) {
+    count[codes[c].len]++;
+    if (codes[c].len > max_len)
+      max_len = codes[c].len;
+  }
+  if ((size_t)max_len + 1 > cap)
+    return -1;
+  buf[0] = (unsigned char)max_len;
+  for (len = 1; len <= max_len; len++) {
+    if (count[len] > 255)
+      return -1;
+    buf[len] = (unsigned char)count[len];
+  }
+  pos = (size_t)max_len + 1;
+  for (len = 1; len <= max_len; len++) {
+    for (c = 0; c < n_symbols; c++) {
+      if (codes[c].len != len)
+        continue;
+      if (pos + (size_t)wide >= cap)
+        return -1;
+      if (wide)
+        buf[pos++] = (unsigned char)(c >> 8);
+      buf[pos++] = (unsigned char)c;
+    }
+  }
+  return (int)pos;
+}
+
+/* Rebuild a canonical code table of n_symbols entries from
+ * serialize_code_lengths() output. Returns the number of bytes consumed, or
+ * -1 if the data is malformed. */
+int load_code_lengths(const unsigned char *buf, size_t n, int n_symbols,
+                      CodeEntry *codes) {
+  int c, len, max_len, i, wide = n_symbols > NUM_CHARS;
+  size_t pos;
+
+  if (n < 1 || buf[0] > MAX_CODE_LEN || (size_t)buf[0] + 1 > n)
+    return -1;
+  max_len = buf[0];
+  for (c = 0; c < n_symbols; c++) {
+    codes[c].code = 0;
+    codes[c].len = 0;
+  }
+  pos = (size_t)max_len + 1;
+  for (len = 1; len <= max_len; len++) {
+    for (i = 0; i < buf[len]; i++) {
+      if (pos + (size_t)wide >= n)
+        return -1;
+      c = buf[pos++];
+      if (wide)
+        c = (c << 8) | buf[pos++];
+      if (c >= n_symbols || codes[c].len != 0)
+        return -1;
+      codes[c].len = len;
+    }
+  }
+  if (assign_canonical_codes(codes, n_symbols) != 0)
+    return -1;
+  return (int)pos;
+}
+
+static void put_be(unsigned char *p, uint64_t v, int bytes) {
+  int i;
+  for (i = 0; i < bytes; i++)
+    p[i] = (unsigned char)(v >> (8 * (bytes - 1 - i)));
+}
+
+static uint64_t get_be(const unsigned char *p, int bytes) {
+  uint64_t v = 0;
+  int i;
+  for (i = 0; i < bytes; i++)
+    v = (v << 8) | p[i];
+  return v;
+}
+
+/* Big-endian 64-bit load; compilers turn this into one load and a swap */
+static uint64_t load_be64(const unsigned char *p) {
+  return (uint64_t)p[0] << 56 | (uint64_t)p[1] << 48 | (uint64_t)p[2] << 40 |
+         (uint64_t)p[3] << 32 | (uint64_t)p[4] << 24 | (uint64_t)p[5] << 16 |
+         (uint64_t)p[6] << 8 | (uint64_t)p[7];
+}
+
+/* MSB-first bit writer shared by every encoder. Bits collect in a 64-bit
+ * accumulator and leave as whole 32-bit words; bw_finish() pads the last
+ * partial byte with zeros. Running out of room sets a sticky overflow flag
+ * instead of failing each call, so encoders check once at the end. */
+typedef struct {
+  unsigned char *buf;
+  size_t cap, pos;
+  uint64_t acc; /* pending bits, right-aligned */
+  int pending;  /* fewer than 32 between calls */
+  int overflow;
+} BitWriter;
+
+static void bw_init(BitWriter *w, unsigned char *buf, size_t cap) {
+  w->buf = buf;
+  w->cap = cap;
+  w->pos = 0;
+  w->acc = 0;
+  w->pending = 0;
+  w->overflow = 0;
+}
+
+/* Append the low len bits of code (len 0..64; higher bits must be zero) */
+static void bw_put(BitWriter *w, uint64_t code, int len) {
+  if (len > 32) {
+    bw_put(w, code >> 32, len - 32);
+    code &= 0xFFFFFFFFu;
+    len = 32;
+  }
+  w->acc = (w->acc << len) | code;
+  w->pending += len;
+  if (w->pending >= 32) {
+    w->pending -= 32;
+    if (w->pos + 4 <= w->cap)
+      put_be(w->buf + w->pos, w->acc >> w->pending, 4);
+    else
+      w->overflow = 1;
+    w->pos += 4;
+  }
+}
+
+/* Bits written so far */
+static long bw_bits(const BitWriter *w) {
+  return (long)(w->pos * 8) + w->pending;
+}
+
+/* Flush the pending bits. Returns the number of bytes used, or -1 if the
+ * buffer overflowed. */
+static long bw_finish(BitWriter *w) {
+  while (w->pending > 0) {
+    int take = w->pending < 8 ? w->pending : 8;
+    w->pending -= take;
+    if (w->pos < w->cap)
+      w->buf[w->pos] =
+          (unsigned char)(((w->acc >> w->pending) << (8 - take)) & 0xFF);
+    else
+      w->overflow = 1;
+    w->pos++;
+  }
+  return w->overflow ? -1 : (long)w->pos;
+}
+
+/* MSB-first bit reader shared by every decoder: a left-aligned 64-bit window
+ * over a buffer of len bytes, which reads as zeros past the end. */
+typedef struct {
+  const unsigned char *buf;
+  size_t len, pos;
+  uint64_t acc; /* next bits, left-aligned */
+  int avail;    /* valid bits in acc */
+} BitReader;
+
+static void br_init(BitReader *r, const unsigned char *buf, size_t len) {
+  r->buf = buf;
+  r->len = len;
+  r->pos = 0;
+  r->acc = 0;
+  r->avail = 0;
+}
+
+/* Top up the window to at least 56 bits. Away from the end this is one
+ * 8-byte load and no loop: bytes already in the window are loaded again at
+ * the same position, which the OR leaves unchanged. */
+static void br_refill(BitReader *r) {
+  if (r->pos + 8 <= r->len) {
+    int k = (63 - r->avail) >> 3;
+    r->acc |= load_be64(r->buf + r->pos) >> r->avail;
+    r->pos += (size_t)k;
+    r->avail += 8 * k;
+    return;
+  }
+  while (r->avail <= 56) {
+    uint64_t b = r->pos < r->len ? r->buf[r->pos] : 0;
+    r->acc |= b << (56 - r->avail);
+    r->pos++;
+    r->avail += 8;
+  }
+}
+
+/* Next n bits (1..56) without consuming them */
+static uint64_t br_peek(BitReader *r, int n) {
+  if (r->avail < n)
+    br_refill(r);
+  return r->acc >> (64 - n);
+}
+
+static void br_consume(BitReader *r, int n) {
+  r->acc <<= n;
+  r->avail -= n;
+}
+
+/* Bits consumed so far, including any zero padding read past the end */
+static uint64_t br_bits_used(const BitReader *r) {
+  return (uint64_t)r->pos * 8 - (uint64_t)r->avail;
+}
+
+/* Total weighted code length: sum of freq * len over the alphabet */
+unsigned long weighted_bits(const unsigned long *freq, const CodeEntry *codes,
+                            int n_symbols) {
+  unsigned long total = 0;
+  int s;
+  for (s = 0; s < n_symbols; s++)
+    total += freq[s] * (unsigned long)codes[s].len;
+  return total;
+}
+
+/* Encode command string: concatenate each character's Huffman code. Return
+ * total bits. */
+int encode_command(const Codebook *cb, const char *cmd, int *out_bits,
+                   int *out_bytes) {
+  int bits = 0, c;
+  const char *p;
+  for (p = cmd; (c = next_symbol(cb, cmd, &p)) >= 0;)
+    bits += cb->char_codes[c].len;
+  *out_bits = bits;
+  *out_bytes = (bits + 7) / 8;
+  return bits;
+}
+
+/* Pack a command into a 32-bit frame, MSB first: the first character's code
+ * occupies the top bits and the unused low bits are zero. Returns the number
+ * of bits used, or -1 if a character has no code or the command does not fit
+ * in 32 bits. */
+int pack_command(const Codebook *cb, const char *cmd, uint32_t *out) {
+  unsigned char frame[4] = {0, 0, 0, 0};
+  BitWriter w;
+  const char *p;
+  long bits;
+  int c;
+  bw_init(&w, frame, sizeof(frame));
+  for (p = cmd; (c = next_symbol(cb, cmd, &p)) >= 0;) {
+    const CodeEntry *e = &cb->char_codes[c];
+    if (e->len == 0)
+      return -1;
+    bw_put(&w, e->code, e->len);
+    STAT_ADD(symbol_hits[c], 1);
+  }
+  bits = bw_bits(&w);
+  if (bits > 32) {
+    STAT_ADD(over_limit, 1);
+    return -1;
+  }
+  if (bw_finish(&w) < 0)
+    return -1;
+  *out = (uint32_t)get_be(frame, 4);
+  STAT_ADD(encoded, 1);
+  STAT_ADD(bits_out, bits);
+  return (int)bits;
+}
+
+/* Pack a command into a caller-supplied byte buffer, MSB first, with the last
+ * byte zero-padded. Returns the number of bits written, or -1 if a character
+ * has no code or buf is too small. */
+int pack_command_bytes(const Codebook *cb, const char *cmd, unsigned char *buf,
+                       size_t cap) {
+  BitWriter w;
+  const char *p;
+  long bits;
+  int c;
+  bw_init(&w, buf, cap);
+  for (p = cmd; (c = next_symbol(cb, cmd, &p)) >= 0;) {
+    const CodeEntry *e = &cb->char_codes[c];
+    if (e->len == 0)
+      return -1;
+    bw_put(&w, e->code, e->len);
+  }
+  bits = bw_bits(&w);
+  return bw_finish(&w) < 0 ? -1 : (int)bits;
+}
+
+/* Precompute every command's packed bits from cb->char_codes[] so sending a
+ * command is a single table load. Call after each code rebuild. */
+static void build_command_cache(Codebook *cb) {
+  int i;
+  for (i = 0; i < cb->n_commands; i++) {
+    PackedCommand *pc = &cb->cache[i];
+    const char *p;
+    int c;
+    pc->code = 0;
+    pc->frame = 0;
+    pc->len = 0;
+    for (p = cb->commands[i];
+         (c = next_symbol(cb, cb->commands[i], &p)) >= 0;) {
+      const CodeEntry *e = &cb->char_codes[c];
+      if (e->len == 0 || pc->len + e->len > 64) {
+        pc->len = -1;
+        break;
+      }
+      pc->code = (pc->code << e->len) | e->code;
+      pc->len += e->len;
+    }
+    if (pc->len > 0 && pc->len <= 32)
+      pc->frame = (uint32_t)(pc->code << (32 - pc->len));
+  }
+}
+
+/* Build the compact form of cb's character code: entries in symbol order
+ * for characters then prefix tokens, skipping symbols with no code. Returns
+ * 0, or -1 if a character outside COMPACT_CHARS has a code or a code does
+ * not fit in COMPACT_LEN_SHIFT bits. */
+int compact_build(CompactCode *cc, const Codebook *cb) {
+  int c;
+  memset(cc->dense, COMPACT_UNUSED, sizeof(cc->dense));
+  memset(cc->prefix, COMPACT_UNUSED, sizeof(cc->prefix));
+  cc->prefix_tokens = cb->prefix_tokens;
+  cc->n_used = 0;
+  for (c = 0; c < NUM_CODE_SYMBOLS; c++) {
+    const CodeEntry *e = &cb->char_codes[c];
+    if (e->len == 0)
+      continue;
+    if ((c >= COMPACT_CHARS && c < NUM_CHARS) || e->len > COMPACT_LEN_SHIFT)
+      return -1;
+    if (c < NUM_CHARS)
+      cc->dense[c] = (unsigned char)cc->n_used;
+    else
+      cc->prefix[c - NUM_CHARS] = (unsigned char)cc->n_used;
+    cc->entries[cc->n_used++] =
+        (uint32_t)e->len << COMPACT_LEN_SHIFT | (uint32_t)e->code;
+  }
+  return 0;
+}
+
+/* pack_command() from a compact code: same frame, same return values */
+int pack_command_compact(const CompactCode *cc, const char *cmd,
+                         uint32_t *out) {
+  unsigned char frame[4] = {0, 0, 0, 0};
+  const unsigned char *p = (const unsigned char *)cmd;
+  BitWriter w;
+  long bits;
+  bw_init(&w, frame, sizeof(frame));
+  if (cc->prefix_tokens) {
+    int k;
+    for (k = 0; k < NUM_SUBSYSTEMS; k++) {
+      size_t n = strlen(SUBSYSTEMS[k].prefix);
+      if (strncmp(cmd, SUBSYSTEMS[k].prefix, n) == 0) {
+        uint32_t e;
+        if (cc->prefix[k] == COMPACT_UNUSED)
+          return -1;
+        e = cc->entries[cc->prefix[k]];
+        bw_put(&w, COMPACT_CODE(e), COMPACT_LEN(e));
+        STAT_ADD(symbol_hits[PREFIX_SYMBOL(k)], 1);
+        p += n;
+        break;
+      }
+    }
+  }
+  for (; *p; p++) {
+    uint32_t e;
+    if (*p >= COMPACT_CHARS || cc->dense[*p] == COMPACT_UNUSED)
+      return -1;
+    e = cc->entries[cc->dense[*p]];
+    bw_put(&w, COMPACT_CODE(e), COMPACT_LEN(e));
+    STAT_ADD(symbol_hits[*p], 1);
+  }
+  bits = bw_bits(&w);
+  if (bits > 32) {
+    STAT_ADD(over_limit, 1);
+    return -1;
+  }
+  if (bw_finish(&w) < 0)
+    return -1;
+  *out = (uint32_t)get_be(frame, 4);
+  STAT_ADD(encoded, 1);
+  STAT_ADD(bits_out, bits);
+  return (int)bits;
+}
+
+/* Cached form of pack_command(): returns the 32-bit frame for command idx
+ * and its bit count, or -1 if it does not fit in a frame */
+int pack_command_cached(const Codebook *cb, int idx, uint32_t *out) {
+  const PackedCommand *pc = &cb->cache[idx];
+  if (pc->len <= 0 || pc->len > 32)
+    return -1;
+  *out = pc->frame;
+  STAT_ADD(command_uses[idx], 1);
+  STAT_ADD(encoded, 1);
+  STAT_ADD(bits_out, pc->len);
+  return pc->len;
+}
+
+/* Pack n commands (indices into cb->commands[]) back to back into one
+ * MSB-first bitstream, with no byte alignment between messages; the
+ * accumulator carries over from one command to the next. If offsets is
+ * non-NULL, offsets[k] receives the bit offset where message k starts and
+ * offsets[n] the total.
+ * Returns the total number of bits, or -1 on a bad index, a character with no
+ * code, or if buf is too small. */
+long encode_batch(const Codebook *cb, const int *idx, int n, unsigned char *buf,
+                  size_t cap, unsigned long *offsets) {
+  BitWriter w;
+  long bits;
+  int k;
+
+  bw_init(&w, buf, cap);
+  for (k = 0; k < n; k++) {
+    const PackedCommand *pc;
+    const char *cmd, *p;
+    int c;
+    if (idx[k] < 0 || idx[k] >= cb->n_commands)
+      return -1;
+    cmd = cb->commands[idx[k]];
+    if (offsets)
+      offsets[k] = (unsigned long)bw_bits(&w);
+    STAT_ADD(command_uses[idx[k]], 1);
+    /* Whole cached command in one write */
+    pc = &cb->cache[idx[k]];
+    if (pc->len > 0) {
+      bw_put(&w, pc->code, pc->len);
+      continue;
+    }
+    for (p = cmd; (c = next_symbol(cb, cmd, &p)) >= 0;) {
+      const CodeEntry *e = &cb->char_codes[c];
+      if (e->len == 0)
+        return -1;
+      bw_put(&w, e->code, e->len);
+    }
+  }
+  bits = bw_bits(&w);
+  if (bw_finish(&w) < 0)
+    return -1;
+  if (offsets)
+    offsets[n] = (unsigned long)bits;
+  STAT_ADD(encoded, n);
+  STAT_ADD(bits_out, bits);
+  return bits;
+}
+
+/* Build a two-level decode table from a code table of n_symbols entries.
+ * Codes up to DECODE_ROOT_BITS long are replicated across every root slot
+ * that starts with them; longer codes share a secondary table per root prefix,
+ * sized by the longest code under that prefix. Returns 0, or -1 if a code is
+ * longer than DECODE_MAX_BITS or the secondary tables do not fit. */
+int build_decode_table(DecodeTable *t, const CodeEntry *codes, int n_symbols) {
+  unsigned char extra[1 << DECODE_ROOT_BITS];
+  int s, i;
+
+  memset(t, 0, sizeof(*t));
+  memset(extra, 0, sizeof(extra));
+
+  /* Short codes go straight into the root; note how deep each prefix goes */
+  for (s = 0; s < n_symbols; s++) {
+    int len = codes[s].len;
+    unsigned long code = codes[s].code;
+    if (len == 0)
+      continue;
+    if (len > DECODE_MAX_BITS)
+      return -1;
+    if (len <= DECODE_ROOT_BITS) {
+      int base = (int)(code << (DECODE_ROOT_BITS - len));
+      int count = 1 << (DECODE_ROOT_BITS - len);
+      for (i = 0; i < count; i++) {
+        t->root[base + i].value = (unsigned short)s;
+        t->root[base + i].len = (unsigned char)len;
+      }
+    } else {
+      int prefix = (int)(code >> (len - DECODE_ROOT_BITS));
+      if (len - DECODE_ROOT_BITS > extra[prefix])
+        extra[prefix] = (unsigned char)(len - DECODE_ROOT_BITS);
+    }
+  }
+
+  /* Carve a secondary table out of sub[] for each deep prefix */
+  for (i = 0; i < (1 << DECODE_ROOT_BITS); i++) {
+    if (extra[i] == 0)
+      continue;
+    if (t->sub_used + (1 << extra[i]) > DECODE_MAX_SUB)
+      return -1;
+    t->root[i].value = (unsigned short)t->sub_used;
+    t->root[i].sub_bits = extra[i];
+    t->sub_used += 1 << extra[i];
+  }
+
+  for (s = 0; s < n_symbols; s++) {
+    int len = codes[s].len, rem, prefix, base, count;
+    unsigned long code = codes[s].code;
+    if (len <= DECODE_ROOT_BITS)
+      continue;
+    rem = len - DECODE_ROOT_BITS;
+    prefix = (int)(code >> rem);
+    base = t->root[prefix].value +
+           (int)((code & ((1UL << rem) - 1)) << (extra[prefix] - rem));
+    count = 1 << (extra[prefix] - rem);
+    for (i = 0; i < count; i++) {
+      t->sub[base + i].value = (unsigned short)s;
+      t->sub[base + i].len = (unsigned char)len;
+    }
+  }
+  return 0;
+}
+
+/* Resolve the code at the top of a left-aligned 64-bit window */
+static DecodeEntry decode_lookup(const DecodeTable *t, uint64_t window) {
+  DecodeEntry e = t->root[window >> (64 - DECODE_ROOT_BITS)];
+  if (e.sub_bits)
+    e = t->sub[e.value + ((window << DECODE_ROOT_BITS) >> (64 - e.sub_bits))];
+  return e;
+}
+
+/* Decode one code from r, refilling on demand, and consume it. An entry with
+ * len 0 marks an invalid code and consumes nothing. */
+static DecodeEntry br_decode(BitReader *r, const DecodeTable *t) {
+  DecodeEntry e;
+  if (r->avail < DECODE_MAX_BITS)
+    br_refill(r);
+  e = decode_lookup(t, r->acc);
+  br_consume(r, e.len);
+  return e;
+}
+
+/* Decode nbits of MSB-first packed codes from buf into a NUL-terminated
+ * string, expanding prefix tokens. The reader keeps a left-aligned 64-bit
+ * window, so each symbol is one root lookup (plus one secondary lookup for
+ * long codes) and one shift.
+ * Returns the number of characters, or -1 on an invalid or truncated code or
+ * if out is too small. */
+int decode_command_bytes(const DecodeTable *t, const unsigned char *buf,
+                         int nbits, char *out, size_t cap) {
+  BitReader r;
+  size_t n = 0;
+
+  if (nbits < 0)
+    return -1;
+  br_init(&r, buf, (size_t)(nbits + 7) / 8);
+  while (br_bits_used(&r) < (uint64_t)nbits) {
+    DecodeEntry e = br_decode(&r, t);
+    STAT_DECODE(e.len);
+    if (e.len == 0 || br_bits_used(&r) > (uint64_t)nbits || n + 1 >= cap)
+      return -1;
+    if (e.value >= NUM_CHARS) {
+      /* Prefix token: expand to the subsystem prefix */
+      const char *q = SUBSYSTEMS[e.value - NUM_CHARS].prefix;
+      if (n + strlen(q) >= cap)
+        return -1;
+      while (*q)
+        out[n++] = *q++;
+    } else {
+      out[n++] = (char)e.value;
+    }
+  }
+  if (cap == 0)
+    return -1;
+  out[n] = '\0';
+  STAT_ADD(decoded, 1);
+  return (int)n;
+}
+
+/* Decode a 32-bit frame produced by pack_command() */
+int decode_command(const DecodeTable *t, uint32_t frame, int nbits, char *out,
+                   size_t cap) {
+  unsigned char buf[4];
+  put_be(buf, frame, 4);
+  return decode_command_bytes(t, buf, nbits, out, cap);
+}
+
+/* Pack a whole-command code into the top bits of a 32-bit frame. Returns the
+ * number of bits used, or -1 if idx has no code. */
+int pack_command_id(const Codebook *cb, int idx, uint32_t *out) {
+  unsigned char frame[4] = {0, 0, 0, 0};
+  const CodeEntry *e;
+  BitWriter w;
+  if (idx < 0 || idx >= cb->n_commands)
+    return -1;
+  e = &cb->command_codes[idx];
+  if (e->len == 0 || e->len > 32)
+    return -1;
+  bw_init(&w, frame, sizeof(frame));
+  bw_put(&w, e->code, e->len);
+  bw_finish(&w);
+  *out = (uint32_t)get_be(frame, 4);
+  STAT_ADD(command_uses[idx], 1);
+  STAT_ADD(encoded, 1);
+  STAT_ADD(bits_out, e->len);
+  return e->len;
+}
+
+/* Decode the whole-command code at the top of a frame. The code is
+ * self-delimiting, so the bits after it are free for a payload. Returns the
+ * command index and its code length in *out_bits, or -1 on an invalid code. */
+int decode_command_id(const DecodeTable *t, uint32_t frame, int *out_bits) {
+  unsigned char buf[4];
+  BitReader r;
+  DecodeEntry e;
+  put_be(buf, frame, 4);
+  br_init(&r, buf, sizeof(buf));
+  e = br_decode(&r, t);
+  STAT_DECODE(e.len);
+  if (e.len == 0)
+    return -1;
+  STAT_ADD(decoded, 1);
+  *out_bits = e.len;
+  return e.value;
+}
+
+/* Build every table of a codebook: length-limited canonical character codes
+ * (from cb->weight[] if weighted, else from plain string counts), the packed
+ * command cache, whole-command codes, both decode tables and the name hash.
+ * Returns 0, or -1 if a table cannot be built. */
+int codebook_build(Codebook *cb, int weighted) {
+  unsigned long freq[NUM_CODE_SYMBOLS];
+
+  if (weighted)
+    count_weighted_char_freq(cb, freq);
+  else
+    count_char_freq(cb, freq);
+  if (build_limited_codes(freq, NUM_CODE_SYMBOLS, CODE_LEN_LIMIT,
+                          cb->char_codes) < 0)
+    return -1;
+  build_command_cache(cb);
+  if (build_decode_table(&cb->char_decode, cb->char_codes, NUM_CODE_SYMBOLS) !=
+      0)
+    return -1;
+  build_command_codes(cb);
+  if (build_decode_table(&cb->command_decode, cb->command_codes,
+                         cb->n_commands) != 0)
+    return -1;
+  return build_command_hash(cb);
+}
+
+/* IEEE binary16 from a double, rounding to nearest even; magnitudes past
+ * the largest half (65504) become infinity */
+static uint16_t float_to_half(double v) {
+  uint16_t sign = signbit(v) ? 0x8000 : 0;
+  double a = fabs(v), mant;
+  int e;
+  if (isnan(v))
+    return 0x7E00;
+  if (a >= 65520.0)
+    return sign | 0x7C00;
+  frexp(a, &e);
+  if (a == 0 || e - 1 < -14) /* zero or subnormal: steps of 2^-24 */
+    return sign | (uint16_t)rint(ldexp(a, 24));
+  mant = rint((ldexp(a, 1 - e) - 1) * 1024);
+  if (mant == 1024) {
+    mant = 0;
+    e++;
+  }
+  if (e - 1 > 15)
+    return sign | 0x7C00;
+  return sign | (uint16_t)((e - 1 + 15) << 10) | (uint16_t)mant;
+}
+
+static double half_to_float(uint16_t h) {
+  int exp = (h >> 10) & 0x1F, mant = h & 0x3FF;
+  double v;
+  if (exp == 0)
+    v = ldexp(mant, -24);
+  else if (exp == 31)
+    v = mant ? NAN : INFINITY;
+  else
+    v = ldexp(mant + 1024, exp - 25);
+  return h & 0x8000 ? -v : v;
+}
+
+/* Payload width of a value type */
+static int value_bits(const ValueType *vt) {
+  switch (vt->kind) {
+  case VALUE_BOOL:
+    return 1;
+  case VALUE_ENUM8:
+    return 8;
+  case VALUE_INT16:
+  case VALUE_FLOAT16:
+  case VALUE_FIXED16:
+    return 16;
+  default:
+    return 0;
+  }
+}
+
+/* Raw payload bits for value, or -1 if it is out of range for the type */
+static long encode_value(const ValueType *vt, double value) {
+  double raw;
+  switch (vt->kind) {
+  case VALUE_BOOL:
+    return value != 0;
+  case VALUE_ENUM8:
+    raw = rint(value);
+    return raw >= 0 && raw <= 255 ? (long)raw : -1;
+  case VALUE_INT16:
+  case VALUE_FIXED16:
+    raw = rint(vt->kind == VALUE_FIXED16 ? value / vt->scale : value);
+    return raw >= -32768 && raw <= 32767 ? (long)((int32_t)raw & 0xFFFF) : -1;
+  case VALUE_FLOAT16:
+    return fabs(value) <= 65504.0 ? (long)float_to_half(value) : -1;
+  default:
+    return 0;
+  }
+}
+
+static double decode_value(const ValueType *vt, uint32_t raw) {
+  switch (vt->kind) {
+  case VALUE_BOOL:
+  case VALUE_ENUM8:
+    return raw;
+  case VALUE_INT16:
+    return (int16_t)raw;
+  case VALUE_FIXED16:
+    return (int16_t)raw * vt->scale;
+  case VALUE_FLOAT16:
+    return half_to_float((uint16_t)raw);
+  default:
+    return 0;
+  }
+}
+
+/* Pack command idx and its value into one 64-bit CAN frame, MSB first: the
+ * whole-command code, then the payload of cb->value_type[idx], then zeros.
+ * The code is self-delimiting and fixes the type, so no length or type field
+ * is sent. Returns the number of bits used, or -1 on a bad index or a value
+ * out of range for its type. */
+int pack_frame(const Codebook *cb, int idx, double value, uint64_t *out) {
+  unsigned char frame[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+  const ValueType *vt;
+  BitWriter w;
+  long raw, bits;
+  if (idx < 0 || idx >= cb->n_commands || cb->command_codes[idx].len == 0)
+    return -1;
+  vt = &cb->value_type[idx];
+  raw = encode_value(vt, value);
+  if (raw < 0)
+    return -1;
+  bw_init(&w, frame, sizeof(frame));
+  bw_put(&w, cb->command_codes[idx].code, cb->command_codes[idx].len);
+  bw_put(&w, (uint64_t)raw, value_bits(vt));
+  bits = bw_bits(&w);
+  if (bw_finish(&w) < 0)
+    return -1;
+  *out = get_be(frame, 8);
+  STAT_ADD(command_uses[idx], 1);
+  STAT_ADD(encoded, 1);
+  STAT_ADD(bits_out, bits);
+  return (int)bits;
+}
+
+/* Unpack a pack_frame() frame into the command index and its value. Returns
+ * the number of bits used, or -1 on an invalid code. */
+int unpack_frame(const Codebook *cb, uint64_t frame, int *idx, double *value) {
+  unsigned char buf[8];
+  const ValueType *vt;
+  BitReader r;
+  DecodeEntry e;
+  int n;
+  put_be(buf, frame, 8);
+  br_init(&r, buf, sizeof(buf));
+  e = br_decode(&r, &cb->command_decode);
+  STAT_DECODE(e.len);
+  if (e.len == 0)
+    return -1;
+  vt = &cb->value_type[e.value];
+  n = value_bits(vt);
+  *idx = e.value;
+  *value = n ? decode_value(vt, (uint32_t)br_peek(&r, n)) : 0;
+  STAT_ADD(bits_in, n);
+  STAT_ADD(decoded, 1);
+  return e.len + n;
+}
+
+/* Keyframes send each command code length less one in 4 bits */
+typedef char key_len_fits[COMMAND_LEN_LIMIT <= 16 ? 1 : -1];
+
+/* Frames in a keyframe for n commands: the version, then the lengths */
+static int adaptive_key_frames(int n) {
+  return 1 + (n + ADAPT_KEY_LENS - 1) / ADAPT_KEY_LENS;
+}
+
+/* Start adaptive coding over cb, whose weights are the shared starting point;
+ * rebuild every interval commands. The encoder's first frames are the
+ * keyframe for version 0. Returns 0, or -1 if cb has more commands than a
+ * keyframe can describe or the code does not fit the decode table. */
+int adaptive_init(AdaptiveCoder *ac, Codebook *cb, int interval) {
+  int i;
+  if (adaptive_key_frames(cb->n_commands) > 1 + (1 << ADAPT_KEY_INDEX_BITS))
+    return -1;
+  ac->cb = cb;
+  for (i = 0; i < cb->n_commands; i++)
+    ac->observed[i] = cb->weight[i];
+  ac->version = 0;
+  ac->interval = interval > 0 ? interval : ADAPT_INTERVAL;
+  ac->since_rebuild = 0;
+  ac->key_next = 0;
+  ac->lost = 0;
+  build_command_codes(cb);
+  return build_decode_table(&cb->command_decode, cb->command_codes,
+                            cb->n_commands);
+}
+
+/* Count one command; at the end of an interval, rebuild the command code
+ * with the O(n) builder, advance the version and queue its keyframe.
+ * Returns 0, or -1 if the new code does not fit the decode table. */
+static int adaptive_observe(AdaptiveCoder *ac, int idx) {
+  Codebook *cb = ac->cb;
+  int i;
+  ac->observed[idx]++;
+  if (++ac->since_rebuild < ac->interval)
+    return 0;
+  for (i = 0; i < cb->n_commands; i++) {
+    cb->weight[i] = ac->observed[i];
+    ac->observed[i] = (ac->observed[i] + 1) / 2;
+  }
+  build_command_codes(cb);
+  ac->version = (ac->version + 1) & ((1u << ADAPT_KEY_BITS) - 1);
+  ac->since_rebuild = 0;
+  ac->key_next = 0;
+  return build_decode_table(&cb->command_decode, cb->command_codes,
+                            cb->n_commands);
+}
+
+/* Next frame of the keyframe for the encoder's current version. Every frame
+ * starts with ADAPT_KEY_TAG: the first is [0][version], the rest are
+ * [1][index][ADAPT_KEY_LENS code lengths less one, 4 bits each]. A keyframe
+ * is due at the start and after every rebuild, and all of it must be sent
+ * ahead of the next adaptive_encode() frame. Returns the bits used (32), or 0
+ * once no keyframe frame is due. */
+int adaptive_keyframe(AdaptiveCoder *ac, uint32_t *out) {
+  const CodeEntry *codes = ac->cb->command_codes;
+  int n = ac->cb->n_commands, k, first;
+  uint32_t frame = (uint32_t)ADAPT_KEY_TAG << (32 - ADAPT_VERSION_BITS);
+  if (ac->key_next < 0)
+    return 0;
+  if (ac->key_next == 0) {
+    frame |= ac->version;
+  } else {
+    first = (ac->key_next - 1) * ADAPT_KEY_LENS;
+    frame |= 1u << ADAPT_KEY_BITS;
+    frame |= (uint32_t)(ac->key_next - 1) << (ADAPT_KEY_BITS -
+                                              ADAPT_KEY_INDEX_BITS);
+    for (k = 0; k < ADAPT_KEY_LENS && first + k < n; k++)
+      frame |= (uint32_t)(codes[first + k].len - 1)
+               << (ADAPT_KEY_BITS - ADAPT_KEY_INDEX_BITS - 4 * (k + 1));
+  }
+  if (++ac->key_next == adaptive_key_frames(n))
+    ac->key_next = -1;
+  *out = frame;
+  return 32;
+}
+
+/* Encode command idx as [version mod ADAPT_KEY_TAG][command code] at the top
+ * of a 32-bit frame and update the model. Returns the bits used, or -1 on a
+ * bad index or while keyframe frames are due. */
+int adaptive_encode(AdaptiveCoder *ac, int idx, uint32_t *out) {
+  unsigned char frame[4] = {0, 0, 0, 0};
+  const CodeEntry *e;
+  BitWriter w;
+  long bits;
+  if (idx < 0 || idx >= ac->cb->n_commands || ac->key_next >= 0)
+    return -1;
+  e = &ac->cb->command_codes[idx];
+  if (e->len == 0 || e->len > 32 - ADAPT_VERSION_BITS)
+    return -1;
+  bw_init(&w, frame, sizeof(frame));
+  bw_put(&w, ac->version % ADAPT_KEY_TAG, ADAPT_VERSION_BITS);
+  bw_put(&w, e->code, e->len);
+  bits = bw_bits(&w);
+  bw_finish(&w);
+  *out = (uint32_t)get_be(frame, 4);
+  /* The rebuild may replace *e, so the length is taken first */
+  if (adaptive_observe(ac, idx) != 0)
+    return -1;
+  STAT_ADD(command_uses[idx], 1);
+  STAT_ADD(encoded, 1);
+  STAT_ADD(bits_out, bits);
+  return (int)bits;
+}
+
+/* Take one keyframe frame. The version frame suspends decoding until its
+ * lengths are in; the length frames must follow it in order, and the last
+ * one installs the code. Returns -3, or -2 if a length frame is out of
+ * sequence or the lengths are not a valid code (decoding stays suspended
+ * until the next keyframe). */
+static int adaptive_key(AdaptiveCoder *ac, uint32_t frame) {
+  Codebook *cb = ac->cb;
+  int n = cb->n_commands, i, k, first;
+  if (!(frame >> ADAPT_KEY_BITS & 1)) {
+    ac->version = frame & ((1u << ADAPT_KEY_BITS) - 1);
+    ac->key_next = 1;
+    ac->lost = 1;
+    return -3;
+  }
+  k = (int)(frame >> (ADAPT_KEY_BITS - ADAPT_KEY_INDEX_BITS)) &
+      ((1 << ADAPT_KEY_INDEX_BITS) - 1);
+  if (ac->key_next < 1 || k != ac->key_next - 1) {
+    ac->key_next = -1;
+    return -2;
+  }
+  first = k * ADAPT_KEY_LENS;
+  for (i = 0; i < ADAPT_KEY_LENS && first + i < n; i++)
+    cb->command_codes[first + i].len =
+        1 + (int)(frame >> (ADAPT_KEY_BITS - ADAPT_KEY_INDEX_BITS -
+                            4 * (i + 1)) & 0xF);
+  if (++ac->key_next < adaptive_key_frames(n))
+    return -3;
+  ac->key_next = -1;
+  if (assign_canonical_codes(cb->command_codes, n) != 0 ||
+      build_decode_table(&cb->command_decode, cb->command_codes, n) != 0)
+    return -2;
+  ac->lost = 0;
+  return -3;
+}
+
+/* Decode a frame from adaptive_keyframe() or adaptive_encode(). The decoder
+ * does not model the traffic itself: it codes with the table from the last
+ * complete keyframe, so after lost frames it rejoins at the next one.
+ * Returns the command index with the bits used in *out_bits, -1 on an
+ * invalid code, -2 if the frame is not from the decoder's confirmed version
+ * (decoding is then suspended until the next keyframe), or -3 for a
+ * keyframe frame, which carries no command. */
+int adaptive_decode(AdaptiveCoder *ac, uint32_t frame, int *out_bits) {
+  unsigned char buf[4];
+  unsigned tag = frame >> (32 - ADAPT_VERSION_BITS);
+  BitReader r;
+  DecodeEntry e;
+  if (tag == ADAPT_KEY_TAG)
+    return adaptive_key(ac, frame);
+  if (ac->lost || tag != ac->version % ADAPT_KEY_TAG) {
+    ac->lost = 1;
+    return -2;
+  }
+  put_be(buf, frame, 4);
+  br_init(&r, buf, sizeof(buf));
+  br_consume(&r, ADAPT_VERSION_BITS);
+  e = br_decode(&r, &ac->cb->command_decode);
+  STAT_DECODE(e.len);
+  if (e.len == 0)
+    return -1;
+  STAT_ADD(bits_in, ADAPT_VERSION_BITS);
+  STAT_ADD(decoded, 1);
+  *out_bits = e.len + ADAPT_VERSION_BITS;
+  return e.value;
+}
+
+/* Start a SwapBook with cb as version 0 */
+void swap_init(SwapBook *sb, const Codebook *cb) {
+  sb->books[0] = *cb;
+  atomic_init(&sb->version[0], 0);
+  atomic_init(&sb->version[1], SWAP_INVALID);
+  atomic_init(&sb->readers[0], 0);
+  atomic_init(&sb->readers[1], 0);
+  atomic_init(&sb->current, 0);
+  pthread_mutex_init(&sb->update, NULL);
+}
+
+/* Pin slot s if it holds a valid table whose version matches tag under mask
+ * (mask 0 takes any valid table). Returns 0, or -1 without pinning. The
+ * count is raised before the version is read, so a publisher that has
+ * invalidated the slot either sees this reader or is seen by it. */
+static int swap_pin(SwapBook *sb, int s, unsigned tag, unsigned mask,
+                    unsigned *version) {
+  unsigned v;
+  atomic_fetch_add(&sb->readers[s], 1);
+  v = atomic_load(&sb->version[s]);
+  if (v != SWAP_INVALID && (v & mask) == tag) {
+    *version = v;
+    return 0;
+  }
+  atomic_fetch_sub(&sb->readers[s], 1);
+  return -1;
+}
+
+/* Pin the current table for encoding. Lock-free: a retry happens only when
+ * a publish invalidated the slot in between. Returns the slot. */
+static int swap_acquire(SwapBook *sb, unsigned *version) {
+  for (;;) {
+    int s = atomic_load(&sb->current);
+    if (swap_pin(sb, s, 0, 0, version) == 0)
+      return s;
+  }
+}
+
+static void swap_release(SwapBook *sb, int s) {
+  atomic_fetch_sub(&sb->readers[s], 1);
+}
+
+/* Build the next version from the current table with new command weights
+ * and make it current. Only the publisher waits, for readers still on the
+ * slot it reuses. Returns the new version, or -1 if the tables cannot be
+ * built (the current table is kept). */
+long swap_publish(SwapBook *sb, const unsigned long *weight) {
+  int cur, s, i;
+  unsigned v;
+  Codebook *next;
+  pthread_mutex_lock(&sb->update);
+  cur = atomic_load(&sb->current);
+  s = 1 - cur;
+  v = atomic_load(&sb->version[cur]) + 1;
+  if (v == SWAP_INVALID)
+    v = 0;
+  atomic_store(&sb->version[s], SWAP_INVALID);
+  while (atomic_load(&sb->readers[s]) != 0)
+    sched_yield();
+  next = &sb->books[s];
+  *next = sb->books[cur];
+  for (i = 0; i < next->n_commands; i++)
+    next->weight[i] = weight[i];
+  if (codebook_build(next, 1) != 0) {
+    pthread_mutex_unlock(&sb->update);
+    return -1;
+  }
+  atomic_store(&sb->version[s], v);
+  atomic_store(&sb->current, s);
+  pthread_mutex_unlock(&sb->update);
+  return v;
+}
+
+/* Encode command idx as [version tag][command code] at the top of a 32-bit
+ * frame with the current table. Returns the bits used, or -1. */
+int swap_encode(SwapBook *sb, int idx, uint32_t *out) {
+  unsigned char frame[4] = {0, 0, 0, 0};
+  const CodeEntry *e;
+  BitWriter w;
+  unsigned version;
+  int s = swap_acquire(sb, &version), bits = -1;
+  if (idx >= 0 && idx < sb->books[s].n_commands) {
+    e = &sb->books[s].command_codes[idx];
+    if (e->len > 0 && e->len <= 32 - SWAP_VERSION_BITS) {
+      bw_init(&w, frame, sizeof(frame));
+      bw_put(&w, version & ((1u << SWAP_VERSION_BITS) - 1),
+             SWAP_VERSION_BITS);
+      bw_put(&w, e->code, e->len);
+      bits = (int)bw_bits(&w);
+      bw_finish(&w);
+      *out = (uint32_t)get_be(frame, 4);
+      STAT_ADD(command_uses[idx], 1);
+      STAT_ADD(encoded, 1);
+      STAT_ADD(bits_out, bits);
+    }
+  }
+  swap_release(sb, s);
+  return bits;
+}
+
+/* Decode a swap_encode() frame with whichever slot holds its version.
+ * Returns the command index with the bits used in *out_bits, -1 on an
+ * invalid code, or -2 if neither table has the frame's version. */
+int swap_decode(SwapBook *sb, uint32_t frame, int *out_bits) {
+  unsigned mask = (1u << SWAP_VERSION_BITS) - 1, tag, version;
+  unsigned char buf[4];
+  BitReader r;
+  DecodeEntry e;
+  int s;
+  put_be(buf, frame, 4);
+  br_init(&r, buf, sizeof(buf));
+  tag = (unsigned)br_peek(&r, SWAP_VERSION_BITS);
+  br_consume(&r, SWAP_VERSION_BITS);
+  s = atomic_load(&sb->current);
+  if (swap_pin(sb, s, tag, mask, &version) != 0) {
+    s = 1 - s;
+    if (swap_pin(sb, s, tag, mask, &version) != 0)
+      return -2;
+  }
+  e = br_decode(&r, &sb->books[s].command_decode);
+  swap_release(sb, s);
+  STAT_DECODE(e.len);
+  if (e.len == 0)
+    return -1;
+  STAT_ADD(bits_in, SWAP_VERSION_BITS);
+  STAT_ADD(decoded, 1);
+  *out_bits = e.len + SWAP_VERSION_BITS;
+  return e.value;
+}
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void crc32_init(void) {
+  uint32_t c;
+  int b, k;
+  for (b = 0; b < 256; b++) {
+    for (c = (uint32_t)b, k = 0; k < 8; k++)
+      c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+    crc_table[b] = c;
+  }
+}
+
+/* CRC-32 (IEEE, reflected polynomial 0xEDB88320) of n bytes, continuing
+ * from crc (0 to start) */
+static uint32_t crc32_update(uint32_t crc, const unsigned char *p, size_t n) {
+  const uint32_t *table = crc_table;
+  size_t i;
+  pthread_once(&crc_once, crc32_init);
+  crc = ~crc;
+  for (i = 0; i < n; i++)
+    crc = table[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+  return ~crc;
+}
+
+/* Write one stream block: STREAM_SYNC, then big-endian sequence number (4
+ * bytes), command count and payload size (2 each), a CRC-32 over those three
+ * fields and the payload, and the whole-command codes packed MSB-first. Every
+ * block starts on a byte boundary and decodes on its own, so a decoder that
+ * hits a bad block can skip to the next sync marker. A block of no commands
+ * ends the stream. buf holds STREAM_BLOCK_MAX bytes. Returns 0, or -1 on a
+ * write error. */
+static int stream_write_block(const Codebook *cb, const int *idx, int n,
+                              uint32_t seq, unsigned char *buf, FILE *out) {
+  BitWriter w;
+  long bytes;
+  int k;
+
+  bw_init(&w, buf + STREAM_BLOCK_HEAD, STREAM_BLOCK_MAX - STREAM_BLOCK_HEAD);
+  for (k = 0; k < n; k++) {
+    bw_put(&w, cb->command_codes[idx[k]].code, cb->command_codes[idx[k]].len);
+    STAT_ADD(command_uses[idx[k]], 1);
+  }
+  STAT_ADD(encoded, n);
+  STAT_ADD(bits_out, bw_bits(&w));
+  bytes = bw_finish(&w);
+  if (bytes < 0)
+    return -1;
+  memcpy(buf, STREAM_SYNC, 4);
+  put_be(buf + 4, seq, 4);
+  put_be(buf + 8, (uint64_t)n, 2);
+  put_be(buf + 10, (uint64_t)bytes, 2);
+  put_be(buf + 12,
+         crc32_update(crc32_update(0, buf + 4, 8), buf + STREAM_BLOCK_HEAD,
+                      (size_t)bytes),
+         4);
+  bytes += STREAM_BLOCK_HEAD;
+  return fwrite(buf, 1, (size_t)bytes, out) == (size_t)bytes ? 0 : -1;
+}
+
+/* Look up one log line: the first field, as in load_profile(). Returns the
+ * command index, -1 for an unknown name, or -2 for a blank or comment line. */
+static int stream_line_command(const Codebook *cb, char *line) {
+  char *name = line;
+  while (*name == ' ' || *name == '\t')
+    name++;
+  if (*name == '\0' || *name == '\r' || *name == '#')
+    return -2;
+  name[strcspn(name, ", \t\r")] = '\0';
+  return find_command(cb, name);
+}
+
+/* stream_encode() with its buffers: chunk of STREAM_IO_BUF bytes and block
+ * of STREAM_BLOCK_MAX */
+static long stream_encode_buffered(const Codebook *cb, FILE *in, FILE *out,
+                                   long *skipped, char *chunk,
+                                   unsigned char *block) {
+  unsigned char table[1 + MAX_CODE_LEN + 2 * MAX_COMMANDS];
+  char line[PROFILE_LINE];
+  int idx[STREAM_BLOCK];
+  int table_bytes, n = 0;
+  uint32_t seq = 0;
+  size_t got, line_len = 0;
+  long total = 0;
+
+  *skipped = 0;
+  table_bytes = serialize_code_lengths(cb->command_codes, cb->n_commands,
+                                       table, sizeof(table));
+  if (table_bytes < 0)
+    return -1;
+  fwrite(STREAM_MAGIC, 1, 4, out);
+  fputc(table_bytes >> 8, out);
+  fputc(table_bytes & 0xFF, out);
+  fwrite(table, 1, (size_t)table_bytes, out);
+  put_be(table, crc32_update(0, table, (size_t)table_bytes), 4);
+  fwrite(table, 1, 4, out);
+
+  do {
+    size_t pos = 0;
+    got = fread(chunk, 1, STREAM_IO_BUF, in);
+    while (pos < got || (got == 0 && line_len > 0)) {
+      char *nl = pos < got ? memchr(chunk + pos, '\n', got - pos) : NULL;
+      size_t take = (nl ? (size_t)(nl - chunk) : got) - pos;
+      int c;
+      if (line_len + take >= sizeof(line))
+        take = line_len < sizeof(line) - 1 ? sizeof(line) - 1 - line_len : 0;
+      memcpy(line + line_len, chunk + pos, take);
+      line_len += take;
+      pos = nl ? (size_t)(nl - chunk) + 1 : got;
+      if (!nl && got > 0)
+        break; /* line continues in the next chunk */
+      line[line_len] = '\0';
+      line_len = 0;
+      c = stream_line_command(cb, line);
+      if (c == -1)
+        (*skipped)++;
+      if (c < 0)
+        continue;
+      idx[n++] = c;
+      total++;
+      if (n == STREAM_BLOCK) {
+        if (stream_write_block(cb, idx, n, seq++, block, out) != 0)
+          return -1;
+        n = 0;
+      }
+    }
+  } while (got > 0);
+  if (n > 0 && stream_write_block(cb, idx, n, seq++, block, out) != 0)
+    return -1;
+  if (stream_write_block(cb, idx, 0, seq, block, out) != 0)
+    return -1;
+  if (ferror(in) || fflush(out) != 0 || ferror(out))
+    return -1;
+  return total;
+}
+
+/* Compress a log of command names, one per line, from in to out: a header of
+ * STREAM_MAGIC, a 2-byte table size, the serialized whole-command code
+ * lengths and their CRC-32, then numbered blocks of STREAM_BLOCK commands and
+ * an empty end block. Input is read in STREAM_IO_BUF chunks and output
+ * written a block at a time, so any size of log streams through in constant
+ * memory. Lines not naming a command are counted in *skipped and dropped.
+ * Returns the number of commands, or -1 on an I/O error. */
+long stream_encode(const Codebook *cb, FILE *in, FILE *out, long *skipped) {
+  char *chunk = malloc(STREAM_IO_BUF + STREAM_BLOCK_MAX);
+  long total;
+  if (!chunk)
+    return -1;
+  total = stream_encode_buffered(cb, in, out, skipped, chunk,
+                                 (unsigned char *)chunk + STREAM_IO_BUF);
+  free(chunk);
+  return total;
+}
+
+/* Make at least need bytes available from *start in buf (of size cap),
+ * moving the unread tail to the front and reading more as needed. Returns
+ * the bytes available, fewer than need only at end of input. */
+static size_t stream_fill(unsigned char *buf, size_t cap, size_t *start,
+                          size_t *end, size_t need, FILE *in) {
+  if (*end - *start >= need)
+    return *end - *start;
+  memmove(buf, buf + *start, *end - *start);
+  *end -= *start;
+  *start = 0;
+  while (*end < need) {
+    size_t got = fread(buf + *end, 1, cap - *end, in);
+    if (got == 0)
+      break;
+    *end += got;
+  }
+  return *end;
+}
+
+/* Decode the block at p (STREAM_BLOCK_HEAD + avail bytes available) into
+ * command names appended to text. Returns the block size in bytes with its
+ * command count in *n, 0 if the block is incomplete, or -1 if it is corrupt
+ * (bad header, payload or CRC). */
+static long stream_read_block(const Codebook *cb, const unsigned char *p,
+                              size_t avail, char *text, size_t *len, int *n) {
+  size_t nbytes = (size_t)get_be(p + 10, 2), start = *len;
+  BitReader r;
+  int k;
+  *n = (int)get_be(p + 8, 2);
+  if (memcmp(p, STREAM_SYNC, 4) != 0 || *n > STREAM_BLOCK ||
+      nbytes > (size_t)STREAM_BLOCK * 4)
+    return -1;
+  if (avail < nbytes)
+    return 0;
+  if (crc32_update(crc32_update(0, p + 4, 8), p + STREAM_BLOCK_HEAD,
+                   nbytes) != (uint32_t)get_be(p + 12, 4))
+    return -1;
+  br_init(&r, p + STREAM_BLOCK_HEAD, nbytes);
+  for (k = 0; k < *n; k++) {
+    DecodeEntry e = br_decode(&r, &cb->command_decode);
+    const char *name;
+    size_t name_len;
+    STAT_DECODE(e.len);
+    if (e.len == 0 || br_bits_used(&r) > (uint64_t)nbytes * 8) {
+      *len = start;
+      return -1;
+    }
+    name = cb->commands[e.value];
+    name_len = strlen(name);
+    memcpy(text + *len, name, name_len);
+    *len += name_len;
+    text[(*len)++] = '\n';
+  }
+  STAT_ADD(decoded, *n);
+  return (long)(STREAM_BLOCK_HEAD + nbytes);
+}
+
+/* stream_decode() with its buffers: buf of STREAM_IO_BUF bytes and text of
+ * STREAM_TEXT */
+static long stream_decode_buffered(Codebook *cb, FILE *in, FILE *out,
+                                   StreamDamage *damage, unsigned char *buf,
+                                   char *text) {
+  unsigned char head[6], table[1 + MAX_CODE_LEN + 2 * MAX_COMMANDS + 4];
+  size_t table_bytes, start = 0, end = 0;
+  uint32_t expect = 0;
+  long total = 0;
+
+  damage->lost_blocks = 0;
+  damage->skipped_bytes = 0;
+  damage->truncated = 1;
+  if (fread(head, 1, 6, in) != 6 || memcmp(head, STREAM_MAGIC, 4) != 0)
+    return -2;
+  table_bytes = ((size_t)head[4] << 8) | head[5];
+  if (table_bytes + 4 > sizeof(table) ||
+      fread(table, 1, table_bytes + 4, in) != table_bytes + 4 ||
+      crc32_update(0, table, table_bytes) !=
+          (uint32_t)get_be(table + table_bytes, 4))
+    return -2;
+  if (load_code_lengths(table, table_bytes, cb->n_commands,
+                        cb->command_codes) != (int)table_bytes ||
+      build_decode_table(&cb->command_decode, cb->command_codes,
+                         cb->n_commands) != 0)
+    return -2;
+
+  for (;;) {
+    size_t avail = stream_fill(buf, STREAM_IO_BUF, &start, &end,
+                               STREAM_BLOCK_HEAD, in), len = 0;
+    const unsigned char *p = buf + start, *next;
+    uint32_t seq;
+    long size = -1;
+    int n;
+    if (avail < STREAM_BLOCK_HEAD) { /* end of input */
+      damage->skipped_bytes += (long)avail;
+      break;
+    }
+    size = stream_read_block(cb, p, avail - STREAM_BLOCK_HEAD, text, &len, &n);
+    if (size == 0) { /* payload not read yet */
+      avail = stream_fill(buf, STREAM_IO_BUF, &start, &end,
+                          STREAM_BLOCK_HEAD + (size_t)get_be(p + 10, 2), in);
+      p = buf + start;
+      size = stream_read_block(cb, p, avail - STREAM_BLOCK_HEAD, text, &len,
+                               &n);
+    }
+    if (size <= 0) {
+      /* Resynchronize at the next sync marker, keeping a marker that may
+       * continue past the buffered data */
+      next = memchr(p + 1, STREAM_SYNC[0], avail - 1);
+      while (next && p + avail - next >= 4 && memcmp(next, STREAM_SYNC, 4) != 0)
+        next = memchr(next + 1, STREAM_SYNC[0], (size_t)(p + avail - next - 1));
+      if (!next)
+        next = p + avail - 3;
+      damage->skipped_bytes += next - p;
+      start += (size_t)(next - p);
+      continue;
+    }
+    start += (size_t)size;
+    seq = (uint32_t)get_be(p + 4, 4);
+    if (seq >= expect) {
+      damage->lost_blocks += seq - expect;
+      expect = seq + 1;
+    }
+    if (n == 0) {
+      damage->truncated = 0;
+      break;
+    }
+    if (fwrite(text, 1, len, out) != len)
+      return -1;
+    total += n;
+  }
+  if (ferror(in) || fflush(out) != 0 || ferror(out))
+    return -1;
+  return total;
+}
+
+/* Expand a stream_encode() stream from in back to command names, one per
+ * line. The code table comes from the stream header, so the decoder needs no
+ * profile; it replaces cb's whole-command code. A block that fails its CRC
+ * is skipped by scanning for the next sync marker, and gaps in the block
+ * numbers are counted, so a bit error costs one block and not the rest of
+ * the session; *damage reports what was lost. Returns the number of commands
+ * recovered, -1 on an I/O error, or -2 if the stream header is malformed. */
+long stream_decode(Codebook *cb, FILE *in, FILE *out, StreamDamage *damage) {
+  unsigned char *buf = malloc(STREAM_IO_BUF + STREAM_TEXT);
+  long total;
+  if (!buf)
+    return -1;
+  total = stream_decode_buffered(cb, in, out, damage, buf,
+                                 (char *)buf + STREAM_IO_BUF);
+  free(buf);
+  return total;
+}
+
+/* Map a whole file read-only. Returns the mapping (a static empty buffer for
+ * an empty file) with its size in *size, or NULL with errno set. Pipes and
+ * devices report no size and cannot be mapped, so anything but a regular
+ * file fails with EINVAL rather than reading as empty. */
+const unsigned char *map_file(const char *path, size_t *size) {
+  static const unsigned char empty[1];
+  struct stat st;
+  void *p;
+  int fd = open(path, O_RDONLY);
+
+  if (fd < 0)
+    return NULL;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return NULL;
+  }
+  if (!S_ISREG(st.st_mode)) {
+    close(fd);
+    errno = EINVAL;
+    return NULL;
+  }
+  *size = (size_t)st.st_size;
+  if (*size == 0) {
+    close(fd);
+    return empty;
+  }
+  p = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED)
+    return NULL;
+  posix_madvise(p, *size, POSIX_MADV_SEQUENTIAL);
+  return p;
+}
+
+void unmap_file(const unsigned char *p, size_t size) {
+  if (size > 0)
+    munmap((void *)p, size);
+}
+
+/* Byte histogram of a buffer, the raw-byte counterpart of count_char_freq().
+ * A run of one byte value (common in logs) would make every increment wait
+ * for the previous store to the same counter, so each byte of a 64-bit
+ * word goes to its own table (HIST_TABLES of them, merged at the end).
+ * Counters are 32-bit to keep the tables in L1, flushed every HIST_CHUNK
+ * bytes so they cannot wrap. */
+void count_byte_freq(const unsigned char *p, size_t n, unsigned long *freq) {
+  uint32_t sub[HIST_TABLES][NUM_CHARS];
+  size_t i, done = 0;
+  int c, k;
+
+  memset(freq, 0, NUM_CHARS * sizeof(*freq));
+  while (done < n) {
+    size_t len = n - done < HIST_CHUNK ? n - done : HIST_CHUNK;
+    const unsigned char *q = p + done;
+    memset(sub, 0, sizeof(sub));
+    for (i = 0; i + 8 <= len; i += 8) {
+      uint64_t w;
+      memcpy(&w, q + i, 8);
+      sub[0][w & 0xFF]++;
+      sub[1][(w >> 8) & 0xFF]++;
+      sub[2][(w >> 16) & 0xFF]++;
+      sub[3][(w >> 24) & 0xFF]++;
+      sub[4][(w >> 32) & 0xFF]++;
+      sub[5][(w >> 40) & 0xFF]++;
+      sub[6][(w >> 48) & 0xFF]++;
+      sub[7][w >> 56]++;
+    }
+    for (; i < len; i++)
+      sub[0][q[i]]++;
+    for (k = 0; k < HIST_TABLES; k++) {
+      for (c = 0; c < NUM_CHARS; c++)
+        freq[c] += sub[k][c];
+    }
+    done += len;
+  }
+}
+
+/* Worst-case encoded size of an n-byte block */
+size_t archive_block_bound(size_t n) {
+  return ARCHIVE_JUMP + n / 8 * CODE_LEN_LIMIT + 8 * CODE_LEN_LIMIT;
+}
+
+/* Encode n bytes with a byte-alphabet code into out, which must hold
+ * archive_block_bound(n) bytes. Byte i goes to stream i % ARCHIVE_STREAMS;
+ * the segment is a jump table of the first ARCHIVE_STREAMS - 1 stream sizes
+ * (4 bytes each) followed by the byte-aligned streams, so a segment decodes on
+ * its own and its streams decode side by side. Returns the number of bytes
+ * written. */
+size_t encode_byte_block(const CodeEntry *codes, const unsigned char *in,
+                         size_t n, unsigned char *out) {
+  size_t i, pos = ARCHIVE_JUMP, cap = archive_block_bound(n);
+  int s;
+
+  for (s = 0; s < ARCHIVE_STREAMS; s++) {
+    BitWriter w;
+    bw_init(&w, out + pos, cap - pos);
+    for (i = (size_t)s; i < n; i += ARCHIVE_STREAMS)
+      bw_put(&w, codes[in[i]].code, codes[in[i]].len);
+    bw_finish(&w);
+    if (s < ARCHIVE_STREAMS - 1)
+      put_be(out + 4 * s, w.pos, 4);
+    pos += w.pos;
+  }
+  return pos;
+}
+
+/* Decode exactly n bytes from an encode_byte_block() segment of in_len bytes.
+ * The streams have no data dependency on each other, so one loop advances
+ * all ARCHIVE_STREAMS windows and their table lookups overlap in the
+ * pipeline. Returns 0, or -1 on an invalid or truncated code. */
+int decode_byte_block(const DecodeTable *t, const unsigned char *in,
+                      size_t in_len, unsigned char *out, size_t n) {
+  BitReader r[ARCHIVE_STREAMS];
+  size_t i, off = ARCHIVE_JUMP;
+  int s, bad = 0;
+
+  if (in_len < ARCHIVE_JUMP)
+    return -1;
+  for (s = 0; s < ARCHIVE_STREAMS; s++) {
+    size_t len = s < ARCHIVE_STREAMS - 1 ? (size_t)get_be(in + 4 * s, 4)
+                                         : in_len - off;
+    if (len > in_len - off)
+      return -1;
+    br_init(&r[s], in + off, len);
+    off += len;
+  }
+
+  /* A refill leaves at least 56 bits, enough for ARCHIVE_PER_REFILL codes of
+   * up to 15 bits (the longest a nibble stores) */
+  for (i = 0; i + ARCHIVE_STREAMS * ARCHIVE_PER_REFILL <= n;) {
+    int k;
+    for (s = 0; s < ARCHIVE_STREAMS; s++)
+      br_refill(&r[s]);
+    for (k = 0; k < ARCHIVE_PER_REFILL; k++) {
+      for (s = 0; s < ARCHIVE_STREAMS; s++, i++) {
+        DecodeEntry e = decode_lookup(t, r[s].acc);
+        bad |= e.len == 0;
+        br_consume(&r[s], e.len);
+        out[i] = (unsigned char)e.value;
+      }
+    }
+    if (bad)
+      return -1;
+  }
+  for (; i < n; i++) {
+    DecodeEntry e = br_decode(&r[i % ARCHIVE_STREAMS], t);
+    if (e.len == 0)
+      return -1;
+    out[i] = (unsigned char)e.value;
+  }
+  /* Bits taken from each stream, padding excluded, must fit in it */
+  for (s = 0; s < ARCHIVE_STREAMS; s++) {
+    if (br_bits_used(&r[s]) > (uint64_t)r[s].len * 8)
+      return -1;
+  }
+  return 0;
+}
+
+/* One unit of parallel archive work: count a range of the input, or encode or
+ * decode one block. Workers share only read-only inputs and the code. */
+typedef struct {
+  const unsigned char *in;
+  size_t in_len;
+  const CodeEntry *codes;   /* encode */
+  const DecodeTable *table; /* decode */
+  unsigned char *out;       /* archive_block_bound() or ARCHIVE_BLOCK bytes */
+  size_t out_len;
+  unsigned long freq[NUM_CHARS];
+  int rc;
+} ArchiveJob;
+
+static void *count_worker(void *arg) {
+  ArchiveJob *job = arg;
+  count_byte_freq(job->in, job->in_len, job->freq);
+  return NULL;
+}
+
+static void *encode_worker(void *arg) {
+  ArchiveJob *job = arg;
+  job->out_len = encode_byte_block(job->codes, job->in, job->in_len, job->out);
+  return NULL;
+}
+
+static void *decode_worker(void *arg) {
+  ArchiveJob *job = arg;
+  job->rc = decode_byte_block(job->table, job->in, job->in_len, job->out,
+                              job->out_len);
+  return NULL;
+}
+
+/* Worker count to use for a requested n_threads: clamped to 1..MAX_THREADS,
+ * the size of the jobs array */
+static int clamp_threads(int n_threads) {
+  return n_threads < 1 ? 1 : n_threads > MAX_THREADS ? MAX_THREADS : n_threads;
+}
+
+/* Run fn over jobs[0..n-1], one thread each; the caller runs the last job.
+ * A job whose thread cannot be started runs inline, so this always
+ * completes. */
+static void run_jobs(void *(*fn)(void *), ArchiveJob *jobs, int n) {
+  pthread_t tid[MAX_THREADS];
+  int started[MAX_THREADS];
+  int k;
+
+  for (k = 0; k < n - 1; k++) {
+    started[k] = pthread_create(&tid[k], NULL, fn, &jobs[k]) == 0;
+    if (!started[k])
+      fn(&jobs[k]);
+  }
+  if (n > 0)
+    fn(&jobs[n - 1]);
+  for (k = 0; k < n - 1; k++) {
+    if (started[k])
+      pthread_join(tid[k], NULL);
+  }
+}
+
+/* Give each of n jobs a buffer of size bytes. Returns 0, or -1 if out of
+ * memory. */
+static int alloc_job_buffers(ArchiveJob *jobs, int n, size_t size) {
+  int k;
+  for (k = 0; k < n; k++) {
+    jobs[k].out = malloc(size);
+    if (!jobs[k].out)
+      return -1;
+  }
+  return 0;
+}
+
+static void free_job_buffers(ArchiveJob *jobs, int n) {
+  int k;
+  for (k = 0; k < n; k++) {
+    free(jobs[k].out);
+    jobs[k].out = NULL;
+  }
+}
+
+/* Compress a file of arbitrary bytes to out with n_threads workers. The
+ * mapped input is counted in n_threads ranges whose histograms are merged,
+ * a length-limited code is built over the byte alphabet, and ARCHIVE_BLOCK
+ * blocks are then encoded n_threads at a time into byte-aligned segments,
+ * written in block order. The archive is an ARCHIVE_HEADER, the segments, and
+ * an index of 4-byte segment sizes at the end, so blocks can also be decoded
+ * in parallel; the output does not depend on n_threads. Lengths are stored as
+ * nibbles rather than with serialize_code_lengths(), which cannot hold 256
+ * codes of one length, as in uniform data. n_threads is clamped to
+ * 1..MAX_THREADS. Returns 0, or -1 with errno set. */
+int archive_compress(const char *path, FILE *out, int n_threads) {
+  ArchiveJob *jobs;
+  unsigned char head[ARCHIVE_HEADER];
+  unsigned long freq[NUM_CHARS];
+  CodeEntry codes[NUM_CHARS];
+  const unsigned char *in;
+  unsigned char *index = NULL;
+  size_t size, n_blocks, block, chunk;
+  int c, k, rc = 0;
+
+  n_threads = clamp_threads(n_threads);
+  in = map_file(path, &size);
+  if (!in)
+    return -1;
+  jobs = calloc(MAX_THREADS, sizeof(*jobs));
+  if (!jobs) {
+    unmap_file(in, size);
+    return -1;
+  }
+  n_blocks = (size + ARCHIVE_BLOCK - 1) / ARCHIVE_BLOCK;
+  if ((size_t)n_threads > n_blocks)
+    n_threads = n_blocks > 0 ? (int)n_blocks : 1;
+
+  /* Pass 1: per-thread histograms over equal ranges, then merge */
+  chunk = (size + (size_t)n_threads - 1) / (size_t)n_threads;
+  for (k = 0; k < n_threads; k++) {
+    size_t start = chunk * (size_t)k < size ? chunk * (size_t)k : size;
+    jobs[k].in = in + start;
+    jobs[k].in_len = size - start < chunk ? size - start : chunk;
+  }
+  run_jobs(count_worker, jobs, n_threads);
+  memset(freq, 0, sizeof(freq));
+  for (k = 0; k < n_threads; k++) {
+    for (c = 0; c < NUM_CHARS; c++)
+      freq[c] += jobs[k].freq[c];
+  }
+  build_limited_codes(freq, NUM_CHARS, CODE_LEN_LIMIT, codes);
+
+  memcpy(head, ARCHIVE_MAGIC, 4);
+  put_be(head + 4, size, 8);
+  put_be(head + 12, ARCHIVE_BLOCK, 4);
+  for (c = 0; c < NUM_CHARS; c += 2)
+    head[16 + c / 2] = (unsigned char)(codes[c].len << 4 | codes[c + 1].len);
+  index = malloc(4 * n_blocks + 1);
+  if (!index || fwrite(head, 1, sizeof(head), out) != sizeof(head) ||
+      alloc_job_buffers(jobs, n_threads,
+                        archive_block_bound(ARCHIVE_BLOCK)) != 0)
+    rc = -1;
+
+  /* Pass 2: rounds of n_threads blocks */
+  for (block = 0; block < n_blocks && rc == 0; block += (size_t)n_threads) {
+    int n = n_blocks - block < (size_t)n_threads ? (int)(n_blocks - block)
+                                                 : n_threads;
+    for (k = 0; k < n; k++) {
+      size_t start = (block + (size_t)k) * ARCHIVE_BLOCK;
+      jobs[k].in = in + start;
+      jobs[k].in_len =
+          size - start < ARCHIVE_BLOCK ? size - start : ARCHIVE_BLOCK;
+      jobs[k].codes = codes;
+    }
+    run_jobs(encode_worker, jobs, n);
+    for (k = 0; k < n && rc == 0; k++) {
+      put_be(index + 4 * (block + (size_t)k), jobs[k].out_len, 4);
+      if (fwrite(jobs[k].out, 1, jobs[k].out_len, out) != jobs[k].out_len)
+        rc = -1;
+    }
+  }
+  if (rc == 0 && fwrite(index, 1, 4 * n_blocks, out) != 4 * n_blocks)
+    rc = -1;
+  free_job_buffers(jobs, n_threads);
+  free(jobs);
+  free(index);
+  unmap_file(in, size);
+  if (rc != 0 || fflush(out) != 0)
+    return -1;
+  return 0;
+}
+
+/* Expand an archive_compress() file to out, decoding n_threads blocks at a
+ * time (clamped to 1..MAX_THREADS). Returns 0, -1 with errno set on an I/O
+ * error, or -2 if the archive is malformed. */
+int archive_decompress(const char *path, FILE *out, int n_threads) {
+  ArchiveJob *jobs = NULL;
+  DecodeTable *table;
+  CodeEntry codes[NUM_CHARS];
+  const unsigned char *in, *index, *seg;
+  uint64_t orig = 0, n_blocks = 0, block, block_size = 0, total;
+  size_t size;
+  int c, k, rc = 0;
+
+  n_threads = clamp_threads(n_threads);
+  in = map_file(path, &size);
+  if (!in)
+    return -1;
+  table = malloc(sizeof(*table));
+  if (!table) {
+    unmap_file(in, size);
+    return -1;
+  }
+  if (size >= ARCHIVE_HEADER && memcmp(in, ARCHIVE_MAGIC, 4) == 0) {
+    orig = get_be(in + 4, 8);
+    block_size = get_be(in + 12, 4);
+    if (block_size > 0)
+      n_blocks = (orig + block_size - 1) / block_size;
+  }
+  if (block_size == 0 || block_size > ARCHIVE_MAX_BLOCK ||
+      n_blocks > (size - ARCHIVE_HEADER) / 4) {
+    free(table);
+    unmap_file(in, size);
+    return -2;
+  }
+  index = in + size - 4 * n_blocks;
+  for (total = 0, block = 0; block < n_blocks; block++)
+    total += get_be(index + 4 * block, 4);
+  for (c = 0; c < NUM_CHARS; c++)
+    codes[c].len = c & 1 ? in[16 + c / 2] & 0xF : in[16 + c / 2] >> 4;
+  if (total != size - ARCHIVE_HEADER - 4 * n_blocks ||
+      assign_canonical_codes(codes, NUM_CHARS) != 0 ||
+      build_decode_table(table, codes, NUM_CHARS) != 0) {
+    free(table);
+    unmap_file(in, size);
+    return -2;
+  }
+  if ((uint64_t)n_threads > n_blocks)
+    n_threads = n_blocks > 0 ? (int)n_blocks : 1;
+  jobs = calloc(MAX_THREADS, sizeof(*jobs));
+  if (!jobs || alloc_job_buffers(jobs, n_threads, (size_t)block_size) != 0)
+    rc = -1;
+
+  seg = in + ARCHIVE_HEADER;
+  for (block = 0; block < n_blocks && rc == 0; block += (uint64_t)n_threads) {
+    int n = n_blocks - block < (uint64_t)n_threads ? (int)(n_blocks - block)
+                                                   : n_threads;
+    for (k = 0; k < n; k++) {
+      uint64_t start = (block + (uint64_t)k) * block_size;
+      jobs[k].in = seg;
+      jobs[k].in_len = (size_t)get_be(index + 4 * (block + (uint64_t)k), 4);
+      jobs[k].out_len =
+          (size_t)(orig - start < block_size ? orig - start : block_size);
+      jobs[k].table = table;
+      seg += jobs[k].in_len;
+    }
+    run_jobs(decode_worker, jobs, n);
+    for (k = 0; k < n && rc == 0; k++) {
+      if (jobs[k].rc != 0)
+        rc = -2;
+      else if (fwrite(jobs[k].out, 1, jobs[k].out_len, out) != jobs[k].out_len)
+        rc = -1;
+    }
+  }
+  if (jobs)
+    free_job_buffers(jobs, n_threads);
+  free(jobs);
+  free(table);
+  unmap_file(in, size);
+  if (rc == 0 && fflush(out) != 0)
+    rc = -1;
+  return rc;
+}
+
+#ifdef HUFF_STATS
+/* Dump the hot-path counters: totals, bit rates, decode-table behavior and
+ * one count per command and per code symbol used */
+void stats_dump(FILE *f, const Codebook *cb) {
+  const HuffStats *st = &huff_stats;
+  struct timespec now;
+  double secs;
+  int i, col = 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  secs = (double)(now.tv_sec - st->start.tv_sec) +
+         (double)(now.tv_nsec - st->start.tv_nsec) / 1e9;
+  fprintf(f, "Hot-path counters (%.3f s):\n", secs);
+  fprintf(f, "Encoded %lu command(s), %lu bits (%.2f per command, %.0f bits/s)"
+          ", %lu over %d bits\n",
+          st->encoded, st->bits_out,
+          st->encoded ? (double)st->bits_out / st->encoded : 0.0,
+          secs > 0 ? st->bits_out / secs : 0.0, st->over_limit, TARGET_BITS);
+  fprintf(f, "Decoded %lu command(s), %lu bits, %lu table lookups (%.2f%% "
+          "secondary)\n",
+          st->decoded, st->bits_in, st->lookups,
+          st->lookups ? 100.0 * st->secondary_lookups / st->lookups : 0.0);
+  fprintf(f, "Command uses:");
+  for (i = 0; i < cb->n_commands; i++)
+    if (st->command_uses[i]) {
+      fprintf(f, "%s %s=%lu", col++ % 6 ? "" : "\n ", cb->commands[i],
+              st->command_uses[i]);
+    }
+  fprintf(f, "\nSymbol hits:");
+  for (i = 0, col = 0; i < NUM_CODE_SYMBOLS; i++)
+    if (st->symbol_hits[i]) {
+      const char *sep = col++ % 8 ? "" : "\n ";
+      if (i >= NUM_CHARS)
+        fprintf(f, "%s [%s]=%lu", sep, SUBSYSTEMS[i - NUM_CHARS].prefix,
+                st->symbol_hits[i]);
+      else
+        fprintf(f, "%s '%c'=%lu", sep, i, st->symbol_hits[i]);
+    }
+  fprintf(f, "\n");
+}
+#endif
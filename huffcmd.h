@@ -0,0 +1,294 @@
+/*
+ * huffcmd: Huffman coding of CAN command names, linked into the firmware, the
+ * base-station service and the huffman_commands report alike. All state is
+ * caller-owned (Codebook, DecodeTable, AdaptiveCoder, SwapBook), so separate
+ * contexts can be used from separate threads. Build the library and its users
+ * with the same MAX_COMMANDS and HUFF_STATS settings.
+ */
+
+#ifndef HUFFCMD_H
+#define HUFFCMD_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#ifndef MAX_COMMANDS
+#define MAX_COMMANDS 1024 /* per codebook; lower it for small targets */
+#endif
+#define NUM_CHARS 256
+#define MAX_CODE_LEN 64
+#define MAX_LIMITED_LEN 16    /* longest limit build_limited_codes() takes */
+#define CODE_LEN_LIMIT 12     /* default limit: keeps decode tables small */
+#define COMMAND_LEN_LIMIT 16  /* whole-command codes; within DECODE_MAX_BITS */
+#define TARGET_BITS 32
+#define PROFILE_SCALE 100 /* profile rates keep two decimals as weights */
+#define PROFILE_LINE 512
+#define DECODE_ROOT_BITS 9 /* first-level decode table index width */
+#define DECODE_SUB_BITS 12 /* widest secondary table index */
+#define DECODE_MAX_BITS (DECODE_ROOT_BITS + DECODE_SUB_BITS)
+#define DECODE_MAX_SUB 4096 /* total secondary table entries */
+#define ADAPT_VERSION_BITS 2 /* version tag carried in adaptive frames */
+#define ADAPT_INTERVAL 256   /* default commands between adaptive rebuilds */
+#define ADAPT_KEY_TAG ((1u << ADAPT_VERSION_BITS) - 1) /* marks a keyframe */
+#define ADAPT_KEY_BITS (31 - ADAPT_VERSION_BITS) /* keyframe frame body */
+#define ADAPT_KEY_INDEX_BITS 8 /* length frame number in a keyframe */
+#define ADAPT_KEY_LENS 5       /* 4-bit code lengths per keyframe frame */
+#define SWAP_VERSION_BITS 2 /* table version carried in hot-swap frames */
+#define SWAP_INVALID (~0u)  /* version of a slot being rebuilt */
+#define STREAM_IO_BUF (1 << 20) /* bytes per read when streaming */
+#define STREAM_BLOCK 4096       /* commands per stream block */
+#define ARCHIVE_BLOCK (1 << 20) /* input bytes per independent block */
+#define MAX_THREADS 64
+#define COMPACT_CHARS 128 /* compact tables cover 7-bit characters */
+#define COMPACT_LEN_SHIFT 24 /* compact entry: length in the top byte */
+#define COMPACT_UNUSED 0xFF  /* dense index of a symbol with no code */
+#define NUM_COMMANDS 48  /* entries in COMMANDS[]; checked in huffcmd.c */
+#define NUM_SUBSYSTEMS 4 /* entries in SUBSYSTEMS[]; checked in huffcmd.c */
+
+/* Payload carried with a command in a 64-bit frame (see pack_frame()) */
+typedef enum {
+  VALUE_NONE,
+  VALUE_BOOL,    /* 1 bit */
+  VALUE_ENUM8,   /* mode or state number, 8 bits */
+  VALUE_INT16,   /* signed count, 16 bits */
+  VALUE_FLOAT16, /* IEEE half precision, for gains */
+  VALUE_FIXED16  /* signed 16-bit multiple of scale */
+} ValueKind;
+
+typedef struct {
+  ValueKind kind;
+  double scale; /* VALUE_FIXED16: units per step */
+  const char *unit;
+} ValueType;
+
+/* Subsystems by command prefix (matched ignoring case, so "LcKp" belongs to
+ * launch control); each one can carry its own codebook */
+typedef struct {
+  const char *prefix;
+  const char *name;
+} Subsystem;
+
+/* Code alphabet: the 256 characters, then one token per subsystem prefix */
+#define PREFIX_SYMBOL(k) (NUM_CHARS + (k))
+#define NUM_CODE_SYMBOLS (NUM_CHARS + NUM_SUBSYSTEMS)
+
+typedef struct {
+  unsigned long code; /* up to MAX_CODE_LEN bits */
+  int len;
+} CodeEntry;
+
+/* Compact character code for small targets: only the symbols in use, each
+ * one 32-bit entry with the code in the low COMPACT_LEN_SHIFT bits and the
+ * length in the top byte, and dense[] mapping a character to its entry. The
+ * --gen-header tables size entries[] to n_used, so a code of about 40
+ * symbols takes 160 bytes of entries and a 128-byte map instead of 16-byte
+ * CodeEntry structs for every code symbol. This run-time form reserves
+ * COMPACT_ENTRIES entries and is about 670 bytes whatever n_used is. */
+#define COMPACT_CODE(e) ((e) & ((1u << COMPACT_LEN_SHIFT) - 1))
+#define COMPACT_LEN(e) ((int)((e) >> COMPACT_LEN_SHIFT))
+#define COMPACT_ENTRIES (COMPACT_CHARS + NUM_SUBSYSTEMS)
+typedef struct {
+  unsigned char dense[COMPACT_CHARS];   /* character -> entry */
+  unsigned char prefix[NUM_SUBSYSTEMS]; /* prefix token -> entry */
+  int prefix_tokens;
+  int n_used;
+  uint32_t entries[COMPACT_ENTRIES]; /* first n_used are in use */
+} CompactCode;
+
+/* A command's character codes concatenated ahead of time. code holds all
+ * len bits right-aligned; frame is the same bits left-aligned in 32 bits, or 0
+ * if the command does not fit. len is -1 if the command cannot be cached
+ * (longer than 64 bits or a character has no code). */
+typedef struct {
+  uint64_t code;
+  uint32_t frame;
+  int len;
+} PackedCommand;
+
+/* Decode table entry. A direct entry holds a symbol and its code length; a
+ * link entry (sub_bits > 0) points at a secondary table of 2^sub_bits entries
+ * indexed by the bits that follow the DECODE_ROOT_BITS prefix. */
+typedef struct {
+  unsigned short value; /* symbol, or offset of secondary table in sub[] */
+  unsigned char len;    /* full code length in bits; 0 = no such code */
+  unsigned char sub_bits;
+} DecodeEntry;
+
+typedef struct {
+  DecodeEntry root[1 << DECODE_ROOT_BITS];
+  DecodeEntry sub[DECODE_MAX_SUB];
+  int sub_used;
+} DecodeTable;
+
+/* A command dictionary with its own weights and code tables. Several
+ * codebooks coexist in one process, e.g. one per subsystem. */
+typedef struct {
+  const char *name;
+  int n_commands;
+  const char *commands[MAX_COMMANDS];
+  const char *comments[MAX_COMMANDS];
+  unsigned long weight[MAX_COMMANDS]; /* send weight per command */
+  int prefix_tokens; /* code subsystem prefixes as one symbol each */
+  CodeEntry char_codes[NUM_CODE_SYMBOLS]; /* per character and prefix token */
+  PackedCommand cache[MAX_COMMANDS];  /* rebuilt with char_codes */
+  DecodeTable char_decode;
+  CodeEntry command_codes[MAX_COMMANDS]; /* whole-command mode */
+  ValueType value_type[MAX_COMMANDS];    /* payload in 64-bit frames */
+  DecodeTable command_decode;
+  /* Minimal perfect hash from name to index (hash and displace):
+   * hash_name(name, 0) picks a bucket, the bucket's seed picks the slot via
+   * hash_name(name, seed), and hash_slot[] maps the slot to the command.
+   * hash_n is the command count it was built for, 0 once it is stale. */
+  unsigned short hash_seed[MAX_COMMANDS];
+  short hash_slot[MAX_COMMANDS];
+  int hash_n;
+} Codebook;
+
+/* Adaptive whole-command coding. Encoder and decoder each own one, over
+ * identical copies of a codebook. Every interval commands the encoder
+ * rebuilds the command code from the observed counts, halved at each rebuild
+ * so old traffic fades out, and sends it as a keyframe: a frame with the
+ * full version, then the code lengths, which COMMAND_LEN_LIMIT keeps to 4
+ * bits. Each command frame carries the version mod ADAPT_KEY_TAG.
+ *
+ * The decoder codes with the table of the last complete keyframe and only
+ * takes command frames tagged with its version, so a decoder that lost
+ * frames rejects what follows and rejoins at the next keyframe, at most one
+ * interval later. A stale table can only be used if a gap swallows
+ * ADAPT_KEY_TAG keyframes in a row. */
+typedef struct {
+  Codebook *cb;
+  unsigned long observed[MAX_COMMANDS]; /* encoder: decayed send counts */
+  unsigned version; /* rebuilds so far, mod 2^ADAPT_KEY_BITS */
+  int interval, since_rebuild;
+  int key_next; /* keyframe frame due (encoder) or expected (decoder); -1 */
+  int lost;     /* decoder: no table for version, waiting for a keyframe */
+} AdaptiveCoder;
+
+/* What stream_decode() had to skip to get past corrupted data */
+typedef struct {
+  long lost_blocks;   /* blocks missing from the sequence */
+  long skipped_bytes; /* bytes passed over while resynchronizing */
+  int truncated;      /* the end block never arrived */
+} StreamDamage;
+
+/* Double-buffered codebook for online updates. Encoders and decoders pin a
+ * slot by bumping its reader count and checking that its version is still
+ * valid, so they never wait; swap_publish() rebuilds the idle slot from new
+ * weights once its last reader has left and then makes it current. Frames
+ * carry the low SWAP_VERSION_BITS of the version they were coded under, and
+ * the previous table stays decodable until the next update. */
+typedef struct {
+  Codebook books[2];
+  atomic_uint version[2]; /* SWAP_INVALID while a slot is rebuilt */
+  atomic_uint readers[2];
+  atomic_int current;
+  pthread_mutex_t update; /* serializes publishers only */
+} SwapBook;
+
+#ifdef HUFF_STATS
+/* Hot-path counters, compiled in with -DHUFF_STATS and printed by
+ * stats_dump() (the report does so at exit). command_uses[] is indexed like
+ * the codebook that coded the command and doubles as live weights for
+ * swap_publish(). Every path updates them with relaxed atomic adds, so the
+ * totals stay exact when coders run on several threads; the archive workers
+ * do not count. */
+typedef struct {
+  unsigned long command_uses[MAX_COMMANDS];    /* by index, encodes */
+  unsigned long symbol_hits[NUM_CODE_SYMBOLS]; /* per-character encodes */
+  unsigned long encoded, decoded;              /* commands */
+  unsigned long over_limit;        /* per-character codes over 32 bits */
+  unsigned long bits_out, bits_in; /* code bits emitted and consumed */
+  unsigned long lookups, secondary_lookups; /* decode table accesses */
+  struct timespec start;
+} HuffStats;
+
+extern HuffStats huff_stats;
+void stats_dump(FILE *f, const Codebook *cb);
+#endif
+
+/* Built-in command set: shortened names, their full meaning and the value
+ * each carries, all at the same index */
+extern const char *const COMMANDS[];
+extern const char *const COMMENTS[];
+extern const ValueType VALUE_TYPES[];
+extern const Subsystem SUBSYSTEMS[];
+
+/* Codebooks and weights */
+void codebook_init(Codebook *cb, const char *name);
+int codebook_add(Codebook *cb, const char *command, const char *comment);
+int codebook_build(Codebook *cb, int weighted);
+int find_subsystem(const char *cmd);
+int next_symbol(const Codebook *cb, const char *cmd, const char **p);
+int find_command(const Codebook *cb, const char *name);
+int build_command_hash(Codebook *cb);
+int load_profile(const char *path, Codebook *cb);
+void count_char_freq(const Codebook *cb, unsigned long *freq);
+void count_weighted_char_freq(const Codebook *cb, unsigned long *freq);
+
+/* Code construction */
+void build_codes(const unsigned long *freq, int n_symbols, CodeEntry *codes);
+void build_codes_sorted(const unsigned long *freq, int n_symbols,
+                        CodeEntry *codes);
+int build_limited_codes(const unsigned long *freq, int n_symbols, int max_len,
+                        CodeEntry *codes);
+unsigned long weighted_bits(const unsigned long *freq, const CodeEntry *codes,
+                            int n_symbols);
+int serialize_code_lengths(const CodeEntry *codes, int n_symbols,
+                           unsigned char *buf, size_t cap);
+int load_code_lengths(const unsigned char *buf, size_t n, int n_symbols,
+                      CodeEntry *codes);
+int build_decode_table(DecodeTable *t, const CodeEntry *codes, int n_symbols);
+
+/* Per-character command codes */
+int encode_command(const Codebook *cb, const char *cmd, int *out_bits,
+                   int *out_bytes);
+int pack_command(const Codebook *cb, const char *cmd, uint32_t *out);
+int pack_command_bytes(const Codebook *cb, const char *cmd, unsigned char *buf,
+                       size_t cap);
+int pack_command_cached(const Codebook *cb, int idx, uint32_t *out);
+int compact_build(CompactCode *cc, const Codebook *cb);
+int pack_command_compact(const CompactCode *cc, const char *cmd,
+                         uint32_t *out);
+long encode_batch(const Codebook *cb, const int *idx, int n, unsigned char *buf,
+                  size_t cap, unsigned long *offsets);
+int decode_command_bytes(const DecodeTable *t, const unsigned char *buf,
+                         int nbits, char *out, size_t cap);
+int decode_command(const DecodeTable *t, uint32_t frame, int nbits, char *out,
+                   size_t cap);
+
+/* Whole-command codes, alone or with a value */
+int pack_command_id(const Codebook *cb, int idx, uint32_t *out);
+int decode_command_id(const DecodeTable *t, uint32_t frame, int *out_bits);
+int pack_frame(const Codebook *cb, int idx, double value, uint64_t *out);
+int unpack_frame(const Codebook *cb, uint64_t frame, int *idx, double *value);
+
+/* Adaptive and hot-swapped codes */
+int adaptive_init(AdaptiveCoder *ac, Codebook *cb, int interval);
+int adaptive_keyframe(AdaptiveCoder *ac, uint32_t *out);
+int adaptive_encode(AdaptiveCoder *ac, int idx, uint32_t *out);
+int adaptive_decode(AdaptiveCoder *ac, uint32_t frame, int *out_bits);
+void swap_init(SwapBook *sb, const Codebook *cb);
+long swap_publish(SwapBook *sb, const unsigned long *weight);
+int swap_encode(SwapBook *sb, int idx, uint32_t *out);
+int swap_decode(SwapBook *sb, uint32_t frame, int *out_bits);
+
+/* Command streams and byte archives */
+long stream_encode(const Codebook *cb, FILE *in, FILE *out, long *skipped);
+long stream_decode(Codebook *cb, FILE *in, FILE *out, StreamDamage *damage);
+const unsigned char *map_file(const char *path, size_t *size);
+void unmap_file(const unsigned char *p, size_t size);
+void count_byte_freq(const unsigned char *p, size_t n, unsigned long *freq);
+size_t archive_block_bound(size_t n);
+size_t encode_byte_block(const CodeEntry *codes, const unsigned char *in,
+                         size_t n, unsigned char *out);
+int decode_byte_block(const DecodeTable *t, const unsigned char *in,
+                      size_t in_len, unsigned char *out, size_t n);
+int archive_compress(const char *path, FILE *out, int n_threads);
+int archive_decompress(const char *path, FILE *out, int n_threads);
+
+#endif /* HUFFCMD_H */
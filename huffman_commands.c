@@ -2,321 +2,1279 @@
  * Character-level Huffman encoder for COMMANDS array.
  * Uses shortened strings to fit within 32 bits (4 bytes) when encoded.
  * Each character gets a variable-length bit code; a command = concat of char
- * codes.
+ * codes. This file is the report, benchmark and command-line driver; the
+ * coding itself lives in the huffcmd library.
  */
 
+#define _POSIX_C_SOURCE 200809L
+
+#include <ctype.h>
+#include <inttypes.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
-#define MAX_COMMANDS 64
-#define NUM_CHARS 256
-#define MAX_CODE_LEN 64
-#define MAX_HEAP (NUM_CHARS * 2)
-#define TARGET_BITS 32
-
-/* Shortened command strings (for encoding). See COMMENTS[] for full meaning. */
-static const char *COMMANDS[] = {
-    "Pltog",  "Plstat", "Plmode",  "Pltarg", "Plkwlm", "Plinit", "Pltqcm",
-    "Plclmp", "LcKp",   "lcKi",    "lcKd",   "lcpid",  "lcSRT",  "lcLcTog",
-    "lcCSR",  "lcCVD",  "lcTVD",   "lcLTq",  "lcITq",  "lck",    "lcMTq",
-    "lcPTq",  "lcUF",   "lcmode",  "lcSt",   "lcPh",   "efTog",  "efEBk",
-    "efLpCt", "efCOk",  "efTS_s",  "efTC_s", "efESk",  "efESs",  "efLEk",
-    "efTLk",  "efFLp",  "rgRgTog", "rgMd",   "rgApTq", "rgBTN",  "rgRTq",
-    "rgTLD",  "rgTZPD", "rgPBM",   "rgPAC",  "rgPdMu", "rgTk"};
-
-/* Comment for each command: full name or description (same index as
- * COMMANDS[]). */
-static const char *COMMENTS[] = {
-    "Power limit toggle",
-    "Power limit status",
-    "Power limit mode",
-    "Power limit target",
-    "Power limit kW limit",
-    "Power limit init",
-    "Power limit torque command",
-    "Power limit clamp",
-    "Launch control Kp",
-    "Launch control Ki",
-    "Launch control Kd",
-    "Launch control PID",
-    "Launch control slip ratio target",
-    "Launch control LC toggle",
-    "Launch control current slip ratio",
-    "Launch control current velocity difference",
-    "Launch control target velocity difference",
-    "Launch control LC torque command",
-    "Launch control initial torque",
-    "Launch control k",
-    "Launch control max torque",
-    "Launch control previous torque",
-    "Launch control use filter",
-    "Launch control mode",
-    "Launch control state",
-    "Launch control phase",
-    "Efficiency efficiency toggle",
-    "Efficiency energy budget kWh (efEBk)",
-    "Efficiency lap counter",
-    "Efficiency carry over energy kWh (efCOk)",
-    "Efficiency time eff in straights (s)",
-    "Efficiency time eff in corners (s)",
-    "Efficiency energy spent in corners kWh (efESk)",
-    "Efficiency energy spent in straights kWh (efESs)",
-    "Efficiency lap energy spent kWh (efLEk)",
-    "Efficiency total lap distance km (efTLk)",
-    "Efficiency finished lap",
-    "Regen regen toggle",
-    "Regen mode",
-    "Regen APPS torque",
-    "Regen BPS torque Nm",
-    "Regen regen torque command",
-    "Regen torque limit D Nm",
-    "Regen torque at zero pedal D Nm",
-    "Regen percent BPS for max regen",
-    "Regen percent APPS for coasting",
-    "Regen pad mu",
-    "Regen tick"};
-
-#define NUM_COMMANDS ((int)(sizeof(COMMANDS) / sizeof(COMMANDS[0])))
-
-typedef struct Node {
-  int symbol; /* character (0..255), or -1 for internal */
-  unsigned long freq;
-  struct Node *left, *right;
-} Node;
+#include "huffcmd.h"
 
-typedef struct {
-  unsigned long code; /* up to MAX_CODE_LEN bits */
-  int len;
-} CodeEntry;
+#define SWAP_INTERVAL 1024  /* commands between retrained tables in the demo */
+#define SWAP_LAG 16         /* frames in flight between sender and receiver */
+#define ADAPT_LOSS 100      /* one frame in this many lost in the loss demo */
+#define FRAME_COL 10        /* "0x" and eight hex digits of a 32-bit frame */
+#define OPT_NAME 16         /* longest abbreviation + 1 */
+#define OPT_WORDS 6         /* comment words an abbreviation draws on */
+#define OPT_WORD_CHARS 3    /* most characters taken from one word */
+#define OPT_CANDIDATES 4096 /* abbreviations tried per command */
+#define OPT_ROUNDS 16       /* code rebuilds in the search */
+#define BENCH_BUILDS 2000     /* code and table rebuilds per benchmark */
+#define BENCH_OPS 2000000     /* per-command operations per benchmark */
+#define BENCH_BATCH 256       /* commands per encode_batch() call */
+#define BENCH_BYTES (64u << 20) /* synthetic telemetry size */
 
-/* One code per character */
-static CodeEntry char_codes[NUM_CHARS];
+/* Print the low len bits of code as '0'/'1' characters, most significant
+ * first, with one write and no per-bit branch */
+static void print_bits(uint64_t code, int len) {
+  char s[MAX_CODE_LEN];
+  int i;
+  for (i = 0; i < len; i++)
+    s[i] = (char)('0' + ((code >> (len - 1 - i)) & 1));
+  fwrite(s, 1, (size_t)len, stdout);
+}
 
-static Node *heap[MAX_HEAP];
-static int heap_size;
+/* Print the full bit string for a command (each char's code concatenated) */
+static void print_command_bits(const Codebook *cb, const char *cmd) {
+  const char *p;
+  int c;
+  for (p = cmd; (c = next_symbol(cb, cmd, &p)) >= 0;)
+    print_bits(cb->char_codes[c].code, cb->char_codes[c].len);
+}
 
-static void heap_swap(int i, int j) {
-  Node *t = heap[i];
-  heap[i] = heap[j];
-  heap[j] = t;
+static void print_char_code(const Codebook *cb, int c) {
+  print_bits(cb->char_codes[c].code, cb->char_codes[c].len);
 }
 
-static void heap_up(int i) {
-  while (i > 0) {
-    int p = (i - 1) / 2;
-    if (heap[p]->freq <= heap[i]->freq)
-      break;
-    heap_swap(p, i);
-    i = p;
+/* Emit the current tables as a self-contained C header of const arrays, so
+ * firmware links them into flash with no startup cost and both ends of the
+ * link share one code. Returns 0, or -1 on a write error. */
+static int write_header(const Codebook *cb, FILE *f, const char *source) {
+  CompactCode cc;
+  int i;
+
+  fprintf(f, "/*\n * Huffman command tables generated by huffman_commands "
+             "--gen-header.\n * Weights: %s. Do not edit.\n */\n\n",
+          source);
+  fprintf(f, "#ifndef HUFFMAN_TABLES_H\n#define HUFFMAN_TABLES_H\n\n");
+  fprintf(f, "#include <stdint.h>\n#include <string.h>\n\n");
+  fprintf(f, "#define HUFF_NUM_COMMANDS %d\n", cb->n_commands);
+  fprintf(f, "#define HUFF_DECODE_ROOT_BITS %d\n\n", DECODE_ROOT_BITS);
+  fprintf(f, "typedef struct {\n  uint32_t code; /* right-aligned */\n"
+             "  uint8_t len;\n} HuffCode;\n\n");
+  fprintf(f, "typedef struct {\n  uint32_t frame; /* left-aligned; 0 if "
+             "over 32 bits */\n  uint8_t len;\n} HuffCommand;\n\n");
+  fprintf(f, "typedef struct {\n  uint16_t value; /* symbol, or secondary "
+             "table offset */\n  uint8_t len;\n  uint8_t sub_bits;\n"
+             "} HuffDecodeEntry;\n\n");
+
+  fprintf(f, "/* Code per character */\n");
+  fprintf(f, "static const HuffCode huff_char_codes[%d] = {", NUM_CHARS);
+  for (i = 0; i < NUM_CHARS; i++)
+    fprintf(f, "%s{0x%lX, %d},", i % 6 ? " " : "\n    ", cb->char_codes[i].code,
+            cb->char_codes[i].len);
+  fprintf(f, "\n};\n\n");
+
+  if (!cb->prefix_tokens && compact_build(&cc, cb) == 0) {
+    fprintf(f, "/* Compact code: one entry per used character, code in the "
+               "low %d bits and\n * length in the top byte; huff_dense maps "
+               "a character to its entry */\n",
+            COMPACT_LEN_SHIFT);
+    fprintf(f, "#define HUFF_NUM_USED %d\n", cc.n_used);
+    fprintf(f, "#define HUFF_UNUSED 0x%X\n", COMPACT_UNUSED);
+    fprintf(f, "#define HUFF_COMPACT_CODE(e) ((e) & 0x%lXu)\n",
+            (1ul << COMPACT_LEN_SHIFT) - 1);
+    fprintf(f, "#define HUFF_COMPACT_LEN(e) ((e) >> %d)\n", COMPACT_LEN_SHIFT);
+    fprintf(f, "static const uint8_t huff_dense[%d] = {", COMPACT_CHARS);
+    for (i = 0; i < COMPACT_CHARS; i++)
+      fprintf(f, "%s0x%02X,", i % 12 ? " " : "\n    ", cc.dense[i]);
+    fprintf(f, "\n};\n");
+    fprintf(f, "static const uint32_t huff_compact[HUFF_NUM_USED] = {");
+    for (i = 0; i < cc.n_used; i++)
+      fprintf(f, "%s0x%08lXu,", i % 6 ? " " : "\n    ",
+              (unsigned long)cc.entries[i]);
+    fprintf(f, "\n};\n\n");
   }
+
+  fprintf(f, "static const char *const huff_commands[HUFF_NUM_COMMANDS] = {");
+  for (i = 0; i < cb->n_commands; i++)
+    fprintf(f, "%s\"%s\",", i % 6 ? " " : "\n    ", cb->commands[i]);
+  fprintf(f, "\n};\n\n");
+
+  fprintf(f, "/* Minimal perfect hash: name -> huff_commands index */\n");
+  fprintf(f, "static const uint16_t huff_hash_seed[HUFF_NUM_COMMANDS] = {");
+  for (i = 0; i < cb->n_commands; i++)
+    fprintf(f, "%s%u,", i % 10 ? " " : "\n    ", cb->hash_seed[i]);
+  fprintf(f, "\n};\n\n");
+  fprintf(f, "static const int16_t huff_hash_slot[HUFF_NUM_COMMANDS] = {");
+  for (i = 0; i < cb->n_commands; i++)
+    fprintf(f, "%s%d,", i % 10 ? " " : "\n    ", cb->hash_slot[i]);
+  fprintf(f, "\n};\n\n");
+  fprintf(f, "static inline uint32_t huff_hash_name(const char *s,\n"
+             "                                      uint32_t seed) {\n"
+             "  uint32_t h = 2166136261u ^ (seed * 0x9E3779B9u);\n"
+             "  for (; *s; s++) {\n"
+             "    h ^= (unsigned char)*s;\n"
+             "    h *= 16777619u;\n"
+             "  }\n"
+             "  h ^= h >> 16;\n  h *= 0x85EBCA6Bu;\n  h ^= h >> 13;\n"
+             "  h *= 0xC2B2AE35u;\n  h ^= h >> 16;\n"
+             "  return h;\n}\n\n");
+  fprintf(f, "/* Index of a command by name, or -1 */\n"
+             "static inline int huff_find_command(const char *name) {\n"
+             "  uint32_t b = huff_hash_name(name, 0) %% HUFF_NUM_COMMANDS;\n"
+             "  int idx = huff_hash_slot[huff_hash_name(name, "
+             "huff_hash_seed[b]) %%\n"
+             "                           HUFF_NUM_COMMANDS];\n"
+             "  return idx >= 0 && strcmp(huff_commands[idx], name) == 0 ? "
+             "idx : -1;\n}\n\n");
+
+  fprintf(f, "/* Packed frame per command (same index as huff_commands) */\n");
+  fprintf(f, "static const HuffCommand huff_command_frames[HUFF_NUM_COMMANDS] "
+             "= {");
+  for (i = 0; i < cb->n_commands; i++) {
+    const PackedCommand *pc = &cb->cache[i];
+    int fits = pc->len > 0 && pc->len <= 32;
+    fprintf(f, "%s{0x%08lXu, %d},", i % 4 ? " " : "\n    ",
+            (unsigned long)pc->frame, fits ? pc->len : 0);
+  }
+  fprintf(f, "\n};\n\n");
+
+  fprintf(f, "/* Decode table: index by the next HUFF_DECODE_ROOT_BITS bits; "
+             "entries with\n * sub_bits > 0 continue in huff_decode_sub */\n");
+  fprintf(f, "static const HuffDecodeEntry huff_decode_root[%d] = {",
+          1 << DECODE_ROOT_BITS);
+  for (i = 0; i < (1 << DECODE_ROOT_BITS); i++) {
+    const DecodeEntry *e = &cb->char_decode.root[i];
+    fprintf(f, "%s{%d, %d, %d},", i % 6 ? " " : "\n    ", e->value, e->len,
+            e->sub_bits);
+  }
+  fprintf(f, "\n};\n\n");
+  fprintf(f, "static const HuffDecodeEntry huff_decode_sub[%d] = {",
+          cb->char_decode.sub_used ? cb->char_decode.sub_used : 1);
+  for (i = 0; i < cb->char_decode.sub_used; i++) {
+    const DecodeEntry *e = &cb->char_decode.sub[i];
+    fprintf(f, "%s{%d, %d, %d},", i % 6 ? " " : "\n    ", e->value, e->len,
+            e->sub_bits);
+  }
+  if (cb->char_decode.sub_used == 0)
+    fprintf(f, "\n    {0, 0, 0},");
+  fprintf(f, "\n};\n\n#endif /* HUFFMAN_TABLES_H */\n");
+  return ferror(f) ? -1 : 0;
 }
 
-static void heap_down(int i) {
-  for (;;) {
-    int l = 2 * i + 1, r = 2 * i + 2, smallest = i;
-    if (l < heap_size && heap[l]->freq < heap[smallest]->freq)
-      smallest = l;
-    if (r < heap_size && heap[r]->freq < heap[smallest]->freq)
-      smallest = r;
-    if (smallest == i)
-      break;
-    heap_swap(i, smallest);
-    i = smallest;
+/* Shannon entropy, in bits, of a distribution given as counts */
+static double entropy_bits(const unsigned long *freq, int n) {
+  double total = 0, h = 0;
+  int i;
+  for (i = 0; i < n; i++)
+    total += (double)freq[i];
+  for (i = 0; i < n; i++) {
+    if (freq[i] > 0) {
+      double p = (double)freq[i] / total;
+      h -= p * log2(p);
+    }
   }
+  return h;
 }
 
-static void heap_push(Node *n) {
-  heap[heap_size++] = n;
-  heap_up(heap_size - 1);
+/* Smallest width that gives n distinct values a fixed-length code */
+static int fixed_width_bits(int n) {
+  int bits = 0;
+  while ((1L << bits) < n)
+    bits++;
+  return bits;
 }
 
-static Node *heap_pop(void) {
-  Node *top = heap[0];
-  heap[0] = heap[--heap_size];
-  if (heap_size > 0)
-    heap_down(0);
-  return top;
+/* Weighted mean bits per command under cb's character codes, with the longest
+ * command in *max_bits and the number over TARGET_BITS in *over */
+static double weighted_command_bits(const Codebook *cb, int *max_bits,
+                                    int *over) {
+  unsigned long wsum = 0, bsum = 0;
+  int i;
+  *max_bits = 0;
+  *over = 0;
+  for (i = 0; i < cb->n_commands; i++) {
+    unsigned long w = cb->weight[i] ? cb->weight[i] : 1;
+    int bits, bytes;
+    encode_command(cb, cb->commands[i], &bits, &bytes);
+    wsum += w;
+    bsum += w * (unsigned long)bits;
+    if (bits > *max_bits)
+      *max_bits = bits;
+    if (bits > TARGET_BITS)
+      (*over)++;
+  }
+  return wsum ? (double)bsum / (double)wsum : 0;
 }
 
-/* Count character frequencies from all command strings */
-static void count_char_freq(unsigned long *freq) {
-  int c, i;
-  const char *p;
-  for (c = 0; c < NUM_CHARS; c++)
-    freq[c] = 0;
-  for (i = 0; i < NUM_COMMANDS; i++) {
-    for (p = COMMANDS[i]; *p; p++)
-      freq[(unsigned char)*p]++;
+static void print_scheme(const char *name, double bits, int max_bits,
+                         int over, double bound) {
+  printf("%-30s %8.2f %5d %6d %+8.1f%%\n", name, bits, max_bits, over,
+         (bits / bound - 1) * 100);
+}
+
+/* How close each coding scheme comes to optimal under cb's weights (plain
+ * string counts without a profile): entropy and Huffman redundancy of the
+ * character code, then weighted bits per command for every scheme against
+ * the command entropy, the floor for coding commands one at a time. */
+static void print_efficiency_report(const Codebook *cb,
+                                    const Codebook *token_book,
+                                    const char *source) {
+  static Codebook lower;
+  static char lower_names[MAX_COMMANDS][PROFILE_LINE];
+  unsigned long freq[NUM_CODE_SYMBOLS], w[MAX_COMMANDS];
+  unsigned long chars = 0, wsum = 0, id_bits = 0;
+  double h_char, l_char, h_cmd, bits;
+  int i, j, used = 0, lower_used = 0, collisions = 0, longest = 0;
+  int max_bits, over, max_id = 0, width;
+
+  count_weighted_char_freq(cb, freq);
+  for (i = 0; i < NUM_CODE_SYMBOLS; i++) {
+    chars += freq[i];
+    used += freq[i] > 0;
+  }
+  h_char = entropy_bits(freq, NUM_CODE_SYMBOLS);
+  l_char = (double)weighted_bits(freq, cb->char_codes, NUM_CODE_SYMBOLS) /
+           (double)chars;
+  for (i = 0; i < cb->n_commands; i++) {
+    int len = (int)strlen(cb->commands[i]);
+    w[i] = cb->weight[i] ? cb->weight[i] : 1;
+    wsum += w[i];
+    id_bits += w[i] * (unsigned long)cb->command_codes[i].len;
+    if (cb->command_codes[i].len > max_id)
+      max_id = cb->command_codes[i].len;
+    if (len > longest)
+      longest = len;
   }
+  h_cmd = entropy_bits(w, cb->n_commands);
+
+  printf("\nEfficiency vs entropy (weights from %s):\n", source);
+  printf("Characters:   %d used, entropy %.3f bits/char, Huffman %.3f "
+         "bits/char (redundancy %.3f, %.1f%%)\n",
+         used, h_char, l_char, l_char - h_char,
+         (l_char / h_char - 1) * 100);
+  printf("Commands:     %d, entropy %.3f bits/command\n", cb->n_commands,
+         h_cmd);
+  printf("%-30s %8s %5s %6s %9s\n", "Scheme", "Bits/cmd", "Max", "Over32",
+         "vs bound");
+  printf("------------------------------------------------------------\n");
+  print_scheme("Whole-command Huffman", (double)id_bits / (double)wsum, max_id,
+               0, h_cmd);
+  width = fixed_width_bits(cb->n_commands);
+  print_scheme("Fixed-width command ID", width, width, 0, h_cmd);
+  bits = weighted_command_bits(token_book, &max_bits, &over);
+  print_scheme("Prefix tokens + characters", bits, max_bits, over, h_cmd);
+  bits = weighted_command_bits(cb, &max_bits, &over);
+  print_scheme("Per-character Huffman", bits, max_bits, over, h_cmd);
+
+  /* Lowercase-only variant of the same commands and weights */
+  codebook_init(&lower, "lowercase");
+  for (i = 0; i < cb->n_commands; i++) {
+    char *q = lower_names[i];
+    snprintf(q, PROFILE_LINE, "%s", cb->commands[i]);
+    for (; *q; q++)
+      *q = (char)tolower((unsigned char)*q);
+    codebook_add(&lower, lower_names[i], cb->comments[i]);
+    lower.weight[i] = cb->weight[i];
+    for (j = 0; j < i; j++)
+      collisions += strcmp(lower_names[i], lower_names[j]) == 0;
+  }
+  count_weighted_char_freq(&lower, freq);
+  for (i = 0; i < NUM_CODE_SYMBOLS; i++)
+    lower_used += freq[i] > 0;
+  build_limited_codes(freq, NUM_CODE_SYMBOLS, CODE_LEN_LIMIT,
+                      lower.char_codes);
+  bits = weighted_command_bits(&lower, &max_bits, &over);
+  print_scheme("Lowercase-only characters", bits, max_bits, over, h_cmd);
+
+  width = fixed_width_bits(used);
+  for (i = 0, over = 0; i < cb->n_commands; i++)
+    over += width * (int)strlen(cb->commands[i]) > TARGET_BITS;
+  print_scheme("Fixed-width characters", width * (double)chars / (double)wsum,
+               width * longest, over, h_cmd);
+  printf("Lowercase-only: %d characters used instead of %d; %d command "
+         "name(s) collide\n",
+         lower_used, used, collisions);
 }
 
-/* Build Huffman tree from character frequencies; assign code per character */
-static void build_char_codes(const unsigned long *freq) {
-  int c, n_used = 0;
-  Node *root = NULL;
-  heap_size = 0;
+/* Words too common to carry meaning in an abbreviation */
+static const char *const STOPWORDS[] = {
+    "a", "an", "and", "at", "by", "for", "in",
+    "of", "on", "or", "per", "the", "to", "with"};
 
-  for (c = 0; c < NUM_CHARS; c++) {
-    char_codes[c].code = 0;
-    char_codes[c].len = 0;
-    if (freq[c] == 0)
-      continue;
-    Node *n = (Node *)malloc(sizeof(Node));
-    n->symbol = c;
-    n->freq = freq[c];
-    n->left = n->right = NULL;
-    heap_push(n);
-    n_used++;
-  }
-
-  if (n_used == 0)
-    return;
-
-  while (heap_size > 1) {
-    Node *a = heap_pop();
-    Node *b = heap_pop();
-    Node *p = (Node *)malloc(sizeof(Node));
-    p->symbol = -1;
-    p->freq = a->freq + b->freq;
-    p->left = a;
-    p->right = b;
-    heap_push(p);
-  }
-  root = heap_pop();
-
-  /* DFS: left = 0, right = 1 */
-  typedef struct {
-    Node *n;
-    unsigned long code;
-    int len;
-  } StackFrame;
-  StackFrame stack[MAX_CODE_LEN * 2];
-  int sp = 0;
-  stack[sp].n = root;
-  stack[sp].code = 0;
-  stack[sp].len = 0;
-  sp++;
-
-  while (sp > 0) {
-    StackFrame f = stack[--sp];
-    if (f.n->symbol >= 0) {
-      char_codes[f.n->symbol].code = f.code;
-      char_codes[f.n->symbol].len = f.len;
-      continue;
+/* Nonzero if word is in STOPWORDS[], ignoring case */
+static int is_stopword(const char *word) {
+  size_t k;
+  for (k = 0; k < sizeof(STOPWORDS) / sizeof(STOPWORDS[0]); k++) {
+    const char *s = STOPWORDS[k], *w = word;
+    while (*s && tolower((unsigned char)*w) == *s) {
+      s++;
+      w++;
     }
-    if (f.n->right) {
-      stack[sp].n = f.n->right;
-      stack[sp].code = (f.code << 1) | 1;
-      stack[sp].len = f.len + 1;
-      sp++;
+    if (*s == '\0' && *w == '\0')
+      return 1;
+  }
+  return 0;
+}
+
+/* Split a comment into abbreviation source words: the subsystem name at the
+ * start, anything in parentheses and STOPWORDS[] are dropped, as is
+ * punctuation. Returns the number of words (at most OPT_WORDS). */
+static int split_comment(const char *comment, int sub,
+                         char words[][OPT_NAME]) {
+  const char *p = comment;
+  int n = 0, depth = 0;
+  if (sub >= 0) {
+    size_t len = strlen(SUBSYSTEMS[sub].name);
+    if (strncmp(p, SUBSYSTEMS[sub].name, len) == 0)
+      p += len;
+  }
+  while (*p && n < OPT_WORDS) {
+    int len = 0;
+    while (*p && !isalnum((unsigned char)*p)) {
+      depth += (*p == '(') - (*p == ')');
+      p++;
     }
-    if (f.n->left) {
-      stack[sp].n = f.n->left;
-      stack[sp].code = f.code << 1;
-      stack[sp].len = f.len + 1;
-      sp++;
+    while (isalnum((unsigned char)*p)) {
+      if (len < OPT_NAME - 1)
+        words[n][len++] = *p;
+      p++;
     }
+    words[n][len] = '\0';
+    if (len > 0 && depth == 0 && !is_stopword(words[n]))
+      n++;
   }
+  return n;
+}
 
-  /* Free tree */
-  {
-    Node *stk[MAX_HEAP];
-    int stksp = 0;
-    stk[stksp++] = root;
-    while (stksp > 0) {
-      Node *t = stk[--stksp];
-      if (t->left)
-        stk[stksp++] = t->left;
-      if (t->right)
-        stk[stksp++] = t->right;
-      free(t);
+/* Candidate names for command idx: its subsystem prefix followed by the
+ * first 0..OPT_WORD_CHARS characters of each comment word (at least one of
+ * the first, so every name starts from the comment), capitalized (camel
+ * case) or all lowercase when fold is set, plus the hand-made name.
+ * Returns the number written to out. */
+static int gen_candidates(const Codebook *cb, int idx, int fold,
+                          char out[][OPT_NAME], int cap) {
+  char words[OPT_WORDS][OPT_NAME];
+  int take[OPT_WORDS];
+  int sub = find_subsystem(cb->commands[idx]);
+  int n_words = split_comment(cb->comments[idx], sub, words);
+  int n = 0, k;
+  const char *prefix = sub >= 0 ? SUBSYSTEMS[sub].prefix : "";
+
+  snprintf(out[n++], OPT_NAME, "%s", cb->commands[idx]);
+  memset(take, 0, sizeof(take));
+  for (;;) {
+    char *q = out[n];
+    size_t len = strlen(prefix);
+    /* Next combination of per-word lengths, like an odometer */
+    for (k = 0; k < n_words && ++take[k] > OPT_WORD_CHARS; k++)
+      take[k] = 0;
+    if (k == n_words || n == cap)
+      break;
+    if (take[0] == 0)
+      continue;
+    memcpy(q, prefix, len);
+    for (k = 0; k < n_words; k++) {
+      int c;
+      for (c = 0; c < take[k] && words[k][c] && len < OPT_NAME - 1; c++) {
+        char ch = words[k][c];
+        q[len++] = c == 0 ? (char)toupper((unsigned char)ch) : ch;
+      }
     }
+    q[len] = '\0';
+    if (fold) {
+      for (; *q; q++)
+        *q = (char)tolower((unsigned char)*q);
+    }
+    n++;
+  }
+  if (fold) {
+    char *q;
+    for (q = out[0]; *q; q++)
+      *q = (char)tolower((unsigned char)*q);
   }
+  return n;
 }
 
-/* Encode command string: concatenate each character's Huffman code. Return
- * total bits. */
-static int encode_command(const char *cmd, int *out_bits, int *out_bytes) {
+/* Bits for name under codes; characters without a code are charged one bit
+ * more than the longest code, roughly what adding them would cost */
+static int candidate_bits(const CodeEntry *codes, int unseen, const char *s) {
   int bits = 0;
-  const char *p;
-  for (p = cmd; *p; p++) {
-    int c = (unsigned char)*p;
-    bits += char_codes[c].len;
+  for (; *s; s++) {
+    int len = codes[(unsigned char)*s].len;
+    bits += len ? len : unseen;
   }
-  *out_bits = bits;
-  *out_bytes = (bits + 7) / 8;
   return bits;
 }
 
-/* Print the full bit string for a command (each char's code concatenated) */
-static void print_command_bits(const char *cmd) {
-  const char *p;
-  for (p = cmd; *p; p++) {
-    int c = (unsigned char)*p;
-    int len = char_codes[c].len;
-    unsigned long code = char_codes[c].code;
-    int i;
-    for (i = len - 1; i >= 0; i--)
-      putchar(((code >> i) & 1) ? '1' : '0');
+/* Weighted total bits, longest command and count over TARGET_BITS for
+ * names[] coded with a character code built from names[] themselves */
+static unsigned long score_names(const Codebook *cb, char names[][OPT_NAME],
+                                 CodeEntry *codes, int *max_bits, int *over) {
+  static Codebook trial;
+  unsigned long freq[NUM_CODE_SYMBOLS], total = 0;
+  int i;
+  codebook_init(&trial, "trial");
+  for (i = 0; i < cb->n_commands; i++) {
+    codebook_add(&trial, names[i], cb->comments[i]);
+    trial.weight[i] = cb->weight[i];
+  }
+  count_weighted_char_freq(&trial, freq);
+  build_limited_codes(freq, NUM_CODE_SYMBOLS, CODE_LEN_LIMIT, codes);
+  *max_bits = 0;
+  *over = 0;
+  for (i = 0; i < cb->n_commands; i++) {
+    unsigned long w = cb->weight[i] ? cb->weight[i] : 1;
+    int bits = candidate_bits(codes, 0, names[i]);
+    total += w * (unsigned long)bits;
+    if (bits > *max_bits)
+      *max_bits = bits;
+    *over += bits > TARGET_BITS;
+  }
+  return total;
+}
+
+/* Search abbreviations for every command: starting from the hand-made names,
+ * repeatedly rebuild the character code from the current names and move each
+ * command to its cheapest unique candidate that fits TARGET_BITS (or the
+ * cheapest at all if none fits), until nothing changes. The best set seen is
+ * left in best[]. Returns its weighted total bits. */
+static unsigned long optimize_names(const Codebook *cb, int fold,
+                                    char best[][OPT_NAME], int *max_bits,
+                                    int *over) {
+  static char names[MAX_COMMANDS][OPT_NAME], cand[OPT_CANDIDATES][OPT_NAME];
+  CodeEntry codes[NUM_CODE_SYMBOLS];
+  unsigned long best_total, total;
+  int i, j, k, round, changed = 1, mb, ov;
+
+  for (i = 0; i < cb->n_commands; i++)
+    gen_candidates(cb, i, fold, &names[i], 1);
+  best_total = score_names(cb, names, codes, max_bits, over);
+  memcpy(best, names, sizeof(names[0]) * (size_t)cb->n_commands);
+
+  for (round = 0; round < OPT_ROUNDS && changed; round++) {
+    int unseen = 1;
+    for (k = 0; k < NUM_CODE_SYMBOLS; k++) {
+      if (codes[k].len >= unseen)
+        unseen = codes[k].len + 1;
+    }
+    changed = 0;
+    for (i = 0; i < cb->n_commands; i++) {
+      int n = gen_candidates(cb, i, fold, cand, OPT_CANDIDATES);
+      int pick = -1, pick_bits = 0, pick_fits = 0;
+      for (k = 0; k < n; k++) {
+        int bits = candidate_bits(codes, unseen, cand[k]);
+        int fits = bits <= TARGET_BITS, taken = 0;
+        if (pick >= 0 && (fits < pick_fits ||
+                          (fits == pick_fits && bits >= pick_bits)))
+          continue;
+        for (j = 0; j < cb->n_commands && !taken; j++)
+          taken = j != i && strcmp(names[j], cand[k]) == 0;
+        if (taken)
+          continue;
+        pick = k;
+        pick_bits = bits;
+        pick_fits = fits;
+      }
+      if (pick >= 0 && strcmp(names[i], cand[pick]) != 0) {
+        memcpy(names[i], cand[pick], OPT_NAME);
+        changed = 1;
+      }
+    }
+    total = score_names(cb, names, codes, &mb, &ov);
+    if (ov < *over || (ov == *over && total < best_total)) {
+      best_total = total;
+      *max_bits = mb;
+      *over = ov;
+      memcpy(best, names, sizeof(names[0]) * (size_t)cb->n_commands);
+    }
   }
+  return best_total;
+}
+
+/* --optimize: search mixed-case and lowercase abbreviations from COMMENTS[]
+ * under cb's weights, print them beside the hand-made names, and print the
+ * better set as a COMMANDS[] initializer */
+static void run_optimizer(const Codebook *cb, const char *source) {
+  static char hand[MAX_COMMANDS][OPT_NAME], mixed[MAX_COMMANDS][OPT_NAME],
+      lower[MAX_COMMANDS][OPT_NAME];
+  CodeEntry codes[NUM_CODE_SYMBOLS];
+  unsigned long t_hand, t_mixed, t_lower, wsum = 0;
+  int i, m_hand, o_hand, m_mixed, o_mixed, m_lower, o_lower, use_lower;
+  char (*pick)[OPT_NAME];
+
+  for (i = 0; i < cb->n_commands; i++) {
+    snprintf(hand[i], OPT_NAME, "%s", cb->commands[i]);
+    wsum += cb->weight[i] ? cb->weight[i] : 1;
+  }
+  t_hand = score_names(cb, hand, codes, &m_hand, &o_hand);
+  t_mixed = optimize_names(cb, 0, mixed, &m_mixed, &o_mixed);
+  t_lower = optimize_names(cb, 1, lower, &m_lower, &o_lower);
+  use_lower = o_lower < o_mixed || (o_lower == o_mixed && t_lower < t_mixed);
+  pick = use_lower ? lower : mixed;
+
+  printf("Abbreviation search (weights from %s):\n", source);
+  printf("%-44s %-10s %-10s %-10s\n", "Full name", "Hand", "Mixed", "Lower");
+  printf("----------------------------------------------------------------"
+         "--------------\n");
+  for (i = 0; i < cb->n_commands; i++)
+    printf("%-44.44s %-10s %-10s %-10s\n", cb->comments[i], hand[i],
+           mixed[i], lower[i]);
+  printf("\n%-10s %12s %8s %5s %6s\n", "Names", "Total bits", "Bits/cmd",
+         "Max", "Over32");
+  printf("%-10s %12lu %8.2f %5d %6d\n", "Hand", t_hand,
+         (double)t_hand / (double)wsum, m_hand, o_hand);
+  printf("%-10s %12lu %8.2f %5d %6d\n", "Mixed", t_mixed,
+         (double)t_mixed / (double)wsum, m_mixed, o_mixed);
+  printf("%-10s %12lu %8.2f %5d %6d\n", "Lower", t_lower,
+         (double)t_lower / (double)wsum, m_lower, o_lower);
+
+  printf("\n/* %s names from --optimize */\n", use_lower ? "Lower" : "Mixed");
+  printf("const char *const COMMANDS[] = {");
+  for (i = 0; i < cb->n_commands; i++)
+    printf("%s\"%s\"%s", i % 6 ? " " : "\n    ", pick[i],
+           i + 1 < cb->n_commands ? "," : "");
+  printf("};\n");
+}
+
+/* Benchmark clock: wall time from CLOCK_MONOTONIC, plus the time-stamp
+ * counter on x86 for cycle counts (0 elsewhere) */
+typedef struct {
+  struct timespec t0;
+  uint64_t c0;
+} BenchTimer;
+
+/* Background retraining for the hot-swap benchmark */
+typedef struct {
+  SwapBook *sb;
+  const unsigned long *weight[2]; /* alternated on each publish */
+  atomic_int stop;
+  long published;
+} SwapPublisher;
+
+static uint64_t read_cycles(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  uint32_t lo, hi;
+  __asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+  return (uint64_t)hi << 32 | lo;
+#else
+  return 0;
+#endif
+}
+
+static void bench_start(BenchTimer *t) {
+  clock_gettime(CLOCK_MONOTONIC, &t->t0);
+  t->c0 = read_cycles();
 }
 
-static void print_char_code(int c) {
-  int len = char_codes[c].len;
-  unsigned long code = char_codes[c].code;
+/* Print one result line for ops operations over bytes bytes of input (0 when
+ * throughput does not apply) */
+static void bench_report(const BenchTimer *t, const char *name, long ops,
+                         size_t bytes) {
+  struct timespec t1;
+  uint64_t cycles = read_cycles() - t->c0;
+  double ns;
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  ns = (double)(t1.tv_sec - t->t0.tv_sec) * 1e9 +
+       (double)(t1.tv_nsec - t->t0.tv_nsec);
+  printf("%-32s %10ld %10.1f", name, ops, ns / (double)ops);
+  if (bytes > 0 && ns > 0)
+    printf(" %9.1f", (double)bytes / ns * 1e3);
+  else
+    printf(" %9s", "-");
+  if (bytes > 0 && cycles > 0)
+    printf(" %8.2f\n", (double)cycles / (double)bytes);
+  else
+    printf(" %8s\n", "-");
+}
+
+static void *publish_worker(void *arg) {
+  SwapPublisher *p = arg;
+  while (!atomic_load(&p->stop))
+    if (swap_publish(p->sb, p->weight[p->published & 1]) >= 0)
+      p->published++;
+  return NULL;
+}
+
+/* Synthetic telemetry: n bytes of "name,value" lines drawn from cb's commands
+ * by weight, the shape of a decoded CAN log */
+static void make_telemetry(const Codebook *cb, unsigned char *buf, size_t n) {
+  unsigned long total = 0, rng = 12345;
+  size_t pos = 0;
   int i;
-  for (i = len - 1; i >= 0; i--)
-    putchar(((code >> i) & 1) ? '1' : '0');
+  for (i = 0; i < cb->n_commands; i++)
+    total += cb->weight[i] ? cb->weight[i] : 1;
+  while (pos < n) {
+    char line[PROFILE_LINE];
+    unsigned long pick;
+    int len;
+    rng = rng * 1103515245UL + 12345UL;
+    pick = (rng >> 8) % total;
+    for (i = 0; i < cb->n_commands - 1; i++) {
+      unsigned long w = cb->weight[i] ? cb->weight[i] : 1;
+      if (pick < w)
+        break;
+      pick -= w;
+    }
+    len = snprintf(line, sizeof(line), "%s,%lu\n", cb->commands[i],
+                   (rng >> 16) % 4096);
+    if ((size_t)len > n - pos)
+      len = (int)(n - pos);
+    memcpy(buf + pos, line, (size_t)len);
+    pos += (size_t)len;
+  }
+}
+
+/* Bulk byte-code throughput over one buffer: counting, then archive-block
+ * encode and decode in ARCHIVE_BLOCK pieces, one op per input byte */
+static int bench_bytes(const char *label, const unsigned char *in,
+                       size_t size) {
+  static DecodeTable table;
+  unsigned long freq[NUM_CHARS];
+  CodeEntry codes[NUM_CHARS];
+  unsigned char *enc, *dec;
+  size_t *seg, off, n_blocks = (size + ARCHIVE_BLOCK - 1) / ARCHIVE_BLOCK, k;
+  char name[64];
+  BenchTimer t;
+  int rc = 0;
+
+  if (size == 0) {
+    printf("%-32s (empty input, skipped)\n", label);
+    return 0;
+  }
+  enc = malloc(n_blocks * archive_block_bound(ARCHIVE_BLOCK) + 1);
+  dec = malloc(size + 1);
+  seg = malloc((n_blocks + 1) * sizeof(*seg));
+  if (!enc || !dec || !seg) {
+    free(enc);
+    free(dec);
+    free(seg);
+    return -1;
+  }
+
+  bench_start(&t);
+  count_byte_freq(in, size, freq);
+  snprintf(name, sizeof(name), "%s count", label);
+  bench_report(&t, name, (long)size, size);
+  build_limited_codes(freq, NUM_CHARS, CODE_LEN_LIMIT, codes);
+  build_decode_table(&table, codes, NUM_CHARS);
+
+  bench_start(&t);
+  for (off = 0, k = 0; k < n_blocks; k++) {
+    size_t len = size - k * ARCHIVE_BLOCK;
+    if (len > ARCHIVE_BLOCK)
+      len = ARCHIVE_BLOCK;
+    seg[k] = off;
+    off += encode_byte_block(codes, in + k * ARCHIVE_BLOCK, len, enc + off);
+  }
+  seg[n_blocks] = off;
+  snprintf(name, sizeof(name), "%s encode", label);
+  bench_report(&t, name, (long)size, size);
+
+  bench_start(&t);
+  for (k = 0; k < n_blocks; k++) {
+    size_t len = size - k * ARCHIVE_BLOCK;
+    if (len > ARCHIVE_BLOCK)
+      len = ARCHIVE_BLOCK;
+    if (decode_byte_block(&table, enc + seg[k], seg[k + 1] - seg[k],
+                          dec + k * ARCHIVE_BLOCK, len) != 0)
+      rc = -1;
+  }
+  snprintf(name, sizeof(name), "%s decode", label);
+  bench_report(&t, name, (long)size, size);
+  if (rc != 0 || memcmp(in, dec, size) != 0) {
+    fprintf(stderr, "%s: decoded data differs from the input\n", label);
+    rc = -1;
+  }
+  free(enc);
+  free(dec);
+  free(seg);
+  return rc;
 }
 
-int main(void) {
-  unsigned long char_freq[NUM_CHARS];
-  int i, total_bits = 0, max_bits = 0, min_bits = 999999;
+/* Time code construction, per-command coding and bulk coding for cb, plus
+ * bulk coding of a recorded log at path if given. Columns are operations,
+ * ns per operation, MB/s and cycles per byte of input (x86 only). Returns 0,
+ * or -1 if a round trip fails or path cannot be read. */
+static int run_bench(const Codebook *cb, const char *path) {
+  static Codebook scratch;
+  static unsigned char batch_buf[BENCH_BATCH * MAX_CODE_LEN];
+  static int batch_idx[BENCH_BATCH];
+  static unsigned long flat[MAX_COMMANDS];
+  CompactCode compact;
+  unsigned long freq[NUM_CODE_SYMBOLS];
+  CodeEntry codes[NUM_CODE_SYMBOLS];
+  volatile uint32_t sink = 0;
+  uint32_t frame = 0;
+  unsigned char *synth;
+  size_t batch_bytes = 0;
+  char text[PROFILE_LINE];
+  BenchTimer t;
+  long i, bits;
+  int bits_i, rc = 0;
+
+  printf("%-32s %10s %10s %9s %8s\n", "Benchmark", "Ops", "ns/op", "MB/s",
+         "cyc/B");
+  scratch = *cb;
+  count_char_freq(cb, freq);
 
-  count_char_freq(char_freq);
-  build_char_codes(char_freq);
+  bench_start(&t);
+  for (i = 0; i < BENCH_BUILDS; i++)
+    build_codes(freq, NUM_CODE_SYMBOLS, codes);
+  bench_report(&t, "build_codes (heap tree)", BENCH_BUILDS, 0);
+  bench_start(&t);
+  for (i = 0; i < BENCH_BUILDS; i++)
+    build_codes_sorted(freq, NUM_CODE_SYMBOLS, codes);
+  bench_report(&t, "build_codes_sorted (two-queue)", BENCH_BUILDS, 0);
+  bench_start(&t);
+  for (i = 0; i < BENCH_BUILDS; i++)
+    build_limited_codes(freq, NUM_CODE_SYMBOLS, CODE_LEN_LIMIT, codes);
+  bench_report(&t, "build_limited_codes", BENCH_BUILDS, 0);
+  bench_start(&t);
+  for (i = 0; i < BENCH_BUILDS; i++)
+    build_decode_table(&scratch.char_decode, cb->char_codes,
+                       NUM_CODE_SYMBOLS);
+  bench_report(&t, "build_decode_table", BENCH_BUILDS, 0);
+  bench_start(&t);
+  for (i = 0; i < BENCH_BUILDS; i++)
+    build_command_hash(&scratch);
+  bench_report(&t, "build_command_hash", BENCH_BUILDS, 0);
+  bench_start(&t);
+  for (i = 0; i < BENCH_BUILDS; i++)
+    codebook_build(&scratch, 1);
+  bench_report(&t, "codebook_build (all tables)", BENCH_BUILDS, 0);
+
+  bench_start(&t);
+  for (i = 0; i < BENCH_OPS; i++) {
+    pack_command(cb, cb->commands[i % cb->n_commands], &frame);
+    sink ^= frame;
+  }
+  bench_report(&t, "pack_command", BENCH_OPS, 0);
+  bench_start(&t);
+  for (i = 0; i < BENCH_OPS; i++) {
+    pack_command_cached(cb, (int)(i % cb->n_commands), &frame);
+    sink ^= frame;
+  }
+  bench_report(&t, "pack_command_cached", BENCH_OPS, 0);
+  if (compact_build(&compact, cb) == 0) {
+    bench_start(&t);
+    for (i = 0; i < BENCH_OPS; i++) {
+      pack_command_compact(&compact, cb->commands[i % cb->n_commands], &frame);
+      sink ^= frame;
+    }
+    bench_report(&t, "pack_command_compact", BENCH_OPS, 0);
+  }
+  bench_start(&t);
+  for (i = 0; i < BENCH_OPS; i++) {
+    pack_command_id(cb, (int)(i % cb->n_commands), &frame);
+    sink ^= frame;
+  }
+  bench_report(&t, "pack_command_id", BENCH_OPS, 0);
+  bench_start(&t);
+  for (i = 0; i < BENCH_OPS; i++) {
+    const PackedCommand *pc = &cb->cache[i % cb->n_commands];
+    if (pc->len > 0 && pc->len <= 32)
+      sink ^= (uint32_t)decode_command(&cb->char_decode, pc->frame, pc->len,
+                                       text, sizeof(text));
+  }
+  bench_report(&t, "decode_command", BENCH_OPS, 0);
+  bench_start(&t);
+  for (i = 0; i < BENCH_OPS; i++) {
+    pack_command_id(cb, (int)(i % cb->n_commands), &frame);
+    sink ^= (uint32_t)decode_command_id(&cb->command_decode, frame, &bits_i);
+  }
+  bench_report(&t, "pack + decode_command_id", BENCH_OPS, 0);
+  bench_start(&t);
+  for (i = 0; i < BENCH_OPS; i++)
+    sink ^= (uint32_t)find_command(cb, cb->commands[i % cb->n_commands]);
+  bench_report(&t, "find_command", BENCH_OPS, 0);
+
+  /* Encoding through a SwapBook, alone and while another thread publishes
+   * retrained tables as fast as it can build them */
+  {
+    SwapBook *sb = malloc(sizeof(*sb));
+    SwapPublisher pub;
+    pthread_t th;
+    long failed = 0;
+    if (!sb)
+      return -1;
+    for (i = 0; i < cb->n_commands; i++)
+      flat[i] = 1;
+    swap_init(sb, cb);
+    bench_start(&t);
+    for (i = 0; i < BENCH_OPS; i++) {
+      failed += swap_encode(sb, (int)(i % cb->n_commands), &frame) < 0;
+      sink ^= frame;
+    }
+    bench_report(&t, "swap_encode", BENCH_OPS, 0);
+    pub.sb = sb;
+    pub.weight[0] = flat;
+    pub.weight[1] = cb->weight;
+    atomic_init(&pub.stop, 0);
+    pub.published = 0;
+    if (pthread_create(&th, NULL, publish_worker, &pub) != 0) {
+      free(sb);
+      return -1;
+    }
+    bench_start(&t);
+    for (i = 0; i < BENCH_OPS; i++) {
+      failed += swap_encode(sb, (int)(i % cb->n_commands), &frame) < 0;
+      sink ^= frame;
+    }
+    bench_report(&t, "swap_encode (while publishing)", BENCH_OPS, 0);
+    atomic_store(&pub.stop, 1);
+    pthread_join(th, NULL);
+    printf("  %ld tables published during the run, %ld encode failures\n",
+           pub.published, failed);
+    pthread_mutex_destroy(&sb->update);
+    free(sb);
+    if (failed)
+      rc = -1;
+  }
+
+  for (i = 0; i < BENCH_BATCH; i++) {
+    batch_idx[i] = (int)(i % cb->n_commands);
+    batch_bytes += strlen(cb->commands[batch_idx[i]]);
+  }
+  bench_start(&t);
+  for (i = 0; i < BENCH_OPS / BENCH_BATCH; i++) {
+    bits = encode_batch(cb, batch_idx, BENCH_BATCH, batch_buf,
+                        sizeof(batch_buf), NULL);
+    sink ^= (uint32_t)bits;
+  }
+  bench_report(&t, "encode_batch (per command)",
+               BENCH_OPS / BENCH_BATCH * BENCH_BATCH,
+               BENCH_OPS / BENCH_BATCH * batch_bytes);
+  (void)sink;
+
+  synth = malloc(BENCH_BYTES);
+  if (!synth)
+    return -1;
+  make_telemetry(cb, synth, BENCH_BYTES);
+  if (bench_bytes("synthetic", synth, BENCH_BYTES) != 0)
+    rc = -1;
+  free(synth);
+  if (path) {
+    size_t size;
+    const unsigned char *log = map_file(path, &size);
+    if (!log) {
+      perror(path);
+      return -1;
+    }
+    if (bench_bytes("recorded", log, size) != 0)
+      rc = -1;
+    unmap_file(log, size);
+  }
+  return rc;
+}
+
+/* Bits and decoder outcomes over one synthetic adaptive session */
+typedef struct {
+  long static_bits[2], adapt_bits[2], key_bits;
+  int sent, decoded, rejected, wrong;
+  int late; /* not decoded although the last keyframe arrived whole */
+} AdaptiveRun;
+
+/* Adaptive coding on a synthetic session, n_phase commands of launch-control
+ * traffic, then as many of an endurance event dominated by efficiency
+ * commands. If loss is nonzero, one frame in loss (keyframes included) never
+ * reaches the decoder. Returns 0, or -1 if a coder cannot be set up. */
+static int run_adaptive(const Codebook *book, int n_phase, int loss,
+                        AdaptiveRun *run) {
+  static Codebook tx_book, rx_book;
+  AdaptiveCoder tx, rx;
+  unsigned long rng = 12345, drop = 54321;
+  int i, phase, whole = 1;
+
+  memset(run, 0, sizeof(*run));
+  tx_book = *book;
+  rx_book = *book;
+  if (adaptive_init(&tx, &tx_book, ADAPT_INTERVAL) != 0 ||
+      adaptive_init(&rx, &rx_book, ADAPT_INTERVAL) != 0)
+    return -1;
+  for (phase = 0; phase < 2; phase++) {
+    const char *hot = phase == 0 ? "lc" : "ef";
+    for (i = 0; i < n_phase; i++) {
+      uint32_t frame = 0, key, unused;
+      int idx, bits, got, got_bits = 0, lost;
+      do {
+        rng = rng * 1103515245UL + 12345UL;
+        idx = (int)((rng >> 16) % (unsigned long)book->n_commands);
+      } while ((rng >> 8) % 20 != 0 &&
+               find_subsystem(book->commands[idx]) != find_subsystem(hot));
+      if (adaptive_keyframe(&tx, &key) > 0) {
+        whole = 1;
+        do {
+          run->key_bits += 32;
+          drop = drop * 1103515245UL + 12345UL;
+          if (loss == 0 || (drop >> 16) % (unsigned long)loss != 0)
+            adaptive_decode(&rx, key, &got_bits);
+          else
+            whole = 0;
+        } while (adaptive_keyframe(&tx, &key) > 0);
+      }
+      bits = adaptive_encode(&tx, idx, &frame);
+      run->static_bits[phase] += pack_command_id(book, idx, &unused);
+      run->adapt_bits[phase] += bits;
+      drop = drop * 1103515245UL + 12345UL;
+      lost = loss > 0 && (drop >> 16) % (unsigned long)loss == 0;
+      if (bits <= 0 || lost)
+        continue;
+      run->sent++;
+      got = adaptive_decode(&rx, frame, &got_bits);
+      if (got == idx && got_bits == bits)
+        run->decoded++;
+      else if (got < 0)
+        run->rejected++;
+      else
+        run->wrong++;
+      if (whole && (got != idx || got_bits != bits))
+        run->late++;
+    }
+  }
+  return 0;
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "usage: %s [--profile FILE] [--gen-header FILE|-]\n"
+          "       %s [--profile FILE] --encode FILE|-\n"
+          "       %s --decode FILE|-\n"
+          "       %s [-j N] --compress|--decompress IN OUT|-\n"
+          "       %s [--profile FILE] --bench [LOG]\n"
+          "       %s [--profile FILE] --optimize\n",
+          prog, prog, prog, prog, prog, prog);
+  fprintf(stderr, "  --profile FILE     weight codes by a log of command "
+                  "names, one per line,\n"
+                  "                     or a CSV of send rates with a "
+                  "name,rate header\n");
+  fprintf(stderr, "  --gen-header FILE  write the code tables as a C header "
+                  "instead of the report\n");
+  fprintf(stderr, "  --encode FILE      compress a log of command names, one "
+                  "per line, to stdout\n");
+  fprintf(stderr, "  --decode FILE      expand an --encode stream back to "
+                  "command names on stdout\n");
+  fprintf(stderr, "  --compress IN OUT  archive any file (e.g. a telemetry "
+                  "log) with a byte-level code\n");
+  fprintf(stderr, "  --decompress IN OUT  restore a --compress archive\n");
+  fprintf(stderr, "  -j N               archive with N threads (default: "
+                  "one per CPU)\n");
+  fprintf(stderr, "  --bench [LOG]      time code builds, per-command and "
+                  "bulk coding (LOG: a recorded log)\n");
+  fprintf(stderr, "  --optimize         search abbreviations of the full "
+                  "names for the fewest weighted bits\n");
+}
+
+#ifdef HUFF_STATS
+static const Codebook *stats_book; /* names for the command counters */
+
+static void stats_dump_at_exit(void) { stats_dump(stderr, stats_book); }
+#endif
+
+int main(int argc, char **argv) {
+  static Codebook book, token_book, subsystem_books[NUM_SUBSYSTEMS];
+  static SwapBook swap_tx, swap_rx;
+  unsigned long char_freq[NUM_CODE_SYMBOLS], tree_bits, sent_bits = 0;
+  unsigned long sent = 0;
+  const char *profile = NULL, *header = NULL, *encode = NULL, *decode = NULL;
+  const char *archive_in = NULL, *archive_out = NULL;
+  const char *bench_log = NULL;
+  int unpack = 0, n_threads = 0, bench = 0, optimize = 0, resync_ok = 0;
+  int i, k, total_bits = 0, max_bits = 0, min_bits = 999999, decoded_ok = 0;
+  unsigned char table_buf[1 + MAX_CODE_LEN + 2 * NUM_CODE_SYMBOLS];
+  CodeEntry tree_codes[NUM_CODE_SYMBOLS], rx_codes[NUM_CODE_SYMBOLS];
+  int table_bytes, longest = 0, id_bits = 0, id_ok = 0, aligned_bytes = 0;
+  int rx_match = 1;
+  int batch_idx[MAX_COMMANDS];
+  unsigned char batch_buf[MAX_COMMANDS * MAX_CODE_LEN];
+  long batch_bits;
+
+#ifdef HUFF_STATS
+  clock_gettime(CLOCK_MONOTONIC, &huff_stats.start);
+  stats_book = &book;
+  atexit(stats_dump_at_exit);
+#endif
+  for (i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc) {
+      profile = argv[++i];
+    } else if (strcmp(argv[i], "--gen-header") == 0 && i + 1 < argc) {
+      header = argv[++i];
+    } else if (strcmp(argv[i], "--encode") == 0 && i + 1 < argc) {
+      encode = argv[++i];
+    } else if (strcmp(argv[i], "--decode") == 0 && i + 1 < argc) {
+      decode = argv[++i];
+    } else if ((strcmp(argv[i], "--compress") == 0 ||
+                strcmp(argv[i], "--decompress") == 0) &&
+               i + 2 < argc) {
+      unpack = argv[i][2] == 'd';
+      archive_in = argv[++i];
+      archive_out = argv[++i];
+    } else if (strcmp(argv[i], "--optimize") == 0) {
+      optimize = 1;
+    } else if (strcmp(argv[i], "--bench") == 0) {
+      bench = 1;
+      if (i + 1 < argc && argv[i + 1][0] != '-')
+        bench_log = argv[++i];
+    } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+      n_threads = atoi(argv[++i]);
+      if (n_threads < 1 || n_threads > MAX_THREADS) {
+        fprintf(stderr, "-j takes 1..%d threads\n", MAX_THREADS);
+        return 2;
+      }
+    } else {
+      usage(argv[0]);
+      return 2;
+    }
+  }
+
+  if (archive_in) {
+    FILE *out = stdout;
+    int rc;
+    if (strcmp(archive_out, "-") != 0)
+      out = fopen(archive_out, "wb");
+    if (!out) {
+      perror(archive_out);
+      return 1;
+    }
+    if (n_threads == 0) {
+      long online = sysconf(_SC_NPROCESSORS_ONLN);
+      n_threads = online < 1 ? 1 : online > MAX_THREADS ? MAX_THREADS
+                                                        : (int)online;
+    }
+    rc = unpack ? archive_decompress(archive_in, out, n_threads)
+                : archive_compress(archive_in, out, n_threads);
+    if (out != stdout && fclose(out) != 0 && rc == 0)
+      rc = -1;
+    if (rc == -2)
+      fprintf(stderr, "%s: not a valid archive\n", archive_in);
+    else if (rc != 0)
+      perror(archive_in);
+    return rc == 0 ? 0 : 1;
+  }
+
+  codebook_init(&book, "all commands");
+  for (i = 0; i < NUM_COMMANDS; i++) {
+    codebook_add(&book, COMMANDS[i], COMMENTS[i]);
+    book.value_type[i] = VALUE_TYPES[i];
+  }
+  if (build_command_hash(&book) != 0) {
+    fprintf(stderr, "No perfect hash found for the command names\n");
+    return 1;
+  }
+
+  /* Static string counts unless real send rates are supplied */
+  if (profile && load_profile(profile, &book) < 0) {
+    perror(profile);
+    return 1;
+  }
+  if (codebook_build(&book, profile != NULL) != 0) {
+    fprintf(stderr, "Code too long for the decode table\n");
+    return 1;
+  }
+
+  /* Same commands and weights with subsystem prefixes as single symbols */
+  codebook_init(&token_book, "prefix tokens");
+  token_book.prefix_tokens = 1;
+  for (i = 0; i < book.n_commands; i++) {
+    codebook_add(&token_book, book.commands[i], book.comments[i]);
+    token_book.weight[i] = book.weight[i];
+  }
+  if (codebook_build(&token_book, profile != NULL) != 0) {
+    fprintf(stderr, "Prefix-token code too long for the decode table\n");
+    return 1;
+  }
+
+  /* One codebook per subsystem, sharing the same weights */
+  for (k = 0; k < NUM_SUBSYSTEMS; k++)
+    codebook_init(&subsystem_books[k], SUBSYSTEMS[k].name);
+  for (i = 0; i < book.n_commands; i++) {
+    int sub = find_subsystem(book.commands[i]);
+    if (sub >= 0) {
+      Codebook *sb = &subsystem_books[sub];
+      int j = codebook_add(sb, book.commands[i], book.comments[i]);
+      if (j >= 0)
+        sb->weight[j] = book.weight[i];
+    }
+  }
+  for (k = 0; k < NUM_SUBSYSTEMS; k++) {
+    if (subsystem_books[k].n_commands > 0 &&
+        codebook_build(&subsystem_books[k], profile != NULL) != 0) {
+      fprintf(stderr, "%s: code too long for the decode table\n",
+              subsystem_books[k].name);
+      return 1;
+    }
+  }
+
+  if (bench)
+    return run_bench(&book, bench_log) == 0 ? 0 : 1;
+  if (optimize) {
+    run_optimizer(&book, profile ? profile : "command string counts");
+    return 0;
+  }
+
+  if (encode || decode) {
+    const char *path = encode ? encode : decode;
+    long n, skipped = 0;
+    StreamDamage damage = {0, 0, 0};
+    FILE *in = stdin;
+    if (strcmp(path, "-") != 0)
+      in = fopen(path, encode ? "r" : "rb");
+    if (!in) {
+      perror(path);
+      return 1;
+    }
+    setvbuf(stdout, NULL, _IOFBF, STREAM_IO_BUF);
+    n = encode ? stream_encode(&book, in, stdout, &skipped)
+               : stream_decode(&book, in, stdout, &damage);
+    if (in != stdin)
+      fclose(in);
+    if (n == -2) {
+      fprintf(stderr, "%s: not a valid command stream\n", path);
+      return 1;
+    }
+    if (n < 0) {
+      perror(path);
+      return 1;
+    }
+    if (skipped > 0)
+      fprintf(stderr, "%s: skipped %ld line(s) not naming a command\n", path,
+              skipped);
+    if (damage.lost_blocks > 0 || damage.skipped_bytes > 0)
+      fprintf(stderr,
+              "%s: resynchronized past %ld corrupt byte(s), %ld block(s) "
+              "lost\n",
+              path, damage.skipped_bytes, damage.lost_blocks);
+    if (damage.truncated)
+      fprintf(stderr, "%s: stream ends before its end block\n", path);
+    return 0;
+  }
+
+  if (header) {
+    const char *source = profile ? profile : "command string counts";
+    FILE *f = strcmp(header, "-") == 0 ? stdout : fopen(header, "w");
+    int rc;
+    if (!f) {
+      perror(header);
+      return 1;
+    }
+    rc = write_header(&book, f, source);
+    if (f != stdout && fclose(f) != 0)
+      rc = -1;
+    if (rc != 0) {
+      fprintf(stderr, "%s: write failed\n", header);
+      return 1;
+    }
+    return 0;
+  }
+
+  /* Unbounded tree for comparison with the length-limited code */
+  if (profile)
+    count_weighted_char_freq(&book, char_freq);
+  else
+    count_char_freq(&book, char_freq);
+  build_codes(char_freq, NUM_CODE_SYMBOLS, tree_codes);
+  tree_bits = weighted_bits(char_freq, tree_codes, NUM_CODE_SYMBOLS);
+  for (i = 0; i < NUM_CODE_SYMBOLS; i++) {
+    if (book.char_codes[i].len > longest)
+      longest = book.char_codes[i].len;
+  }
+
+  /* Receiver side: the code rebuilt from the shipped lengths alone */
+  table_bytes = serialize_code_lengths(book.char_codes, NUM_CHARS, table_buf,
+                                       sizeof(table_buf));
+  if (table_bytes < 0 || load_code_lengths(table_buf, (size_t)table_bytes,
+                                           NUM_CHARS, rx_codes) < 0)
+    rx_match = 0;
+  for (i = 0; i < NUM_CHARS && rx_match; i++) {
+    if (rx_codes[i].len != book.char_codes[i].len ||
+        rx_codes[i].code != book.char_codes[i].code)
+      rx_match = 0;
+  }
 
   /* Character code table (only chars that appear) */
+  printf("Weights: %s\n\n",
+         profile ? profile : "character counts of the command strings");
   printf("Huffman codes per character (used in commands):\n");
   printf("%-6s %-8s %s\n", "Char", "Code", "Len");
   printf("----------------------------------------\n");
   for (i = 0; i < NUM_CHARS; i++) {
-    if (char_codes[i].len == 0)
+    if (book.char_codes[i].len == 0)
       continue;
     if (i >= 32 && i < 127)
       printf("'%c'     ", i);
     else
       printf("0x%02X   ", i);
-    print_char_code(i);
-    printf(" %d\n", char_codes[i].len);
+    print_char_code(&book, i);
+    printf(" %d\n", book.char_codes[i].len);
   }
 
   /* Short form -> comment (for reference) */
   printf("\nShort form -> comment (full meaning):\n");
   printf("%-14s %s\n", "Short", "Comment");
   printf("------------------------------------------------------------\n");
-  for (i = 0; i < NUM_COMMANDS; i++)
-    printf("%-14s %s\n", COMMANDS[i], COMMENTS[i]);
+  for (i = 0; i < book.n_commands; i++)
+    printf("%-14s %s\n", book.commands[i], book.comments[i]);
 
   printf("\nEncoded commands (each character -> its bits, concatenated):\n");
-  printf("%-4s %-14s %-44s %6s %6s  %s\n", "Idx", "Command", "Bit string",
-         "Bits", "Bytes", "OK/OVER");
+  printf("%-4s %-14s %-44s %6s %6s  %-7s %-*s\n", "Idx", "Command",
+         "Bit string", "Bits", "Bytes", "OK/OVER", FRAME_COL, "Frame");
   printf("%s\n", "-------------------------------------------------------------"
                  "-------------------");
 
-  for (i = 0; i < NUM_COMMANDS; i++) {
+  for (i = 0; i < book.n_commands; i++) {
     int bits, bytes;
-    const char *cmd = COMMANDS[i];
-    encode_command(cmd, &bits, &bytes);
+    uint32_t frame;
+    char decoded[MAX_CODE_LEN];
+    const char *cmd = book.commands[i];
+    encode_command(&book, cmd, &bits, &bytes);
     total_bits += bits;
+    aligned_bytes += bytes;
+    batch_idx[i] = i;
+    sent_bits += book.weight[i] * (unsigned long)bits;
+    sent += book.weight[i];
     if (bits > max_bits)
       max_bits = bits;
     if (bits < min_bits)
       min_bits = bits;
     printf("%-4d %-14s ", i, cmd);
-    print_command_bits(cmd);
-    printf(" %6d %6d  %s\n", bits, bytes, bits <= TARGET_BITS ? "OK" : "OVER");
+    print_command_bits(&book, cmd);
+    printf(" %6d %6d  %-7s ", bits, bytes, bits <= TARGET_BITS ? "OK" : "OVER");
+    if (pack_command(&book, cmd, &frame) >= 0) {
+      uint32_t cached = 0;
+      char hex[FRAME_COL + 1];
+      if (pack_command_cached(&book, i, &cached) != bits || cached != frame)
+        printf("(cache mismatch) ");
+      snprintf(hex, sizeof(hex), "0x%08lX", (unsigned long)frame);
+      printf("%-*s\n", FRAME_COL, hex);
+      if (decode_command(&book.char_decode, frame, bits, decoded,
+                         sizeof(decoded)) >= 0 &&
+          strcmp(decoded, cmd) == 0)
+        decoded_ok++;
+    } else {
+      /* Too long for one frame: show the byte-packed payload instead */
+      unsigned char buf[MAX_CODE_LEN];
+      int j, n = pack_command_bytes(&book, cmd, buf, sizeof(buf));
+      for (j = 0; j < (n + 7) / 8; j++)
+        printf("%02X", buf[j]);
+      printf("\n");
+      if (decode_command_bytes(&book.char_decode, buf, n, decoded,
+                               sizeof(decoded)) >= 0 &&
+          strcmp(decoded, cmd) == 0)
+        decoded_ok++;
+    }
   }
 
   printf("\n--- When sending (target %d bits / %d bytes max) ---\n",
@@ -324,10 +1282,295 @@ int main(void) {
   printf("Per command:  min %d bits (%d byte(s)), max %d bits (%d byte(s))\n",
          min_bits, (min_bits + 7) / 8, max_bits, (max_bits + 7) / 8);
   printf("Average:      %.2f bits, %.2f bytes (per command)\n",
-         (double)total_bits / NUM_COMMANDS,
-         (double)total_bits / (8.0 * NUM_COMMANDS));
+         (double)total_bits / book.n_commands,
+         (double)total_bits / (8.0 * book.n_commands));
+  batch_bits = encode_batch(&book, batch_idx, book.n_commands, batch_buf,
+                            sizeof(batch_buf), NULL);
+  printf("Batched:      all %d commands in %ld bits (%ld bytes) vs %d bytes "
+         "byte-aligned\n",
+         book.n_commands, batch_bits, (batch_bits + 7) / 8, aligned_bytes);
+  if (profile)
+    printf("Weighted:     %.2f bits per sent command (profile)\n",
+           (double)sent_bits / (double)sent);
+  printf("Round trip:   %d/%d commands decoded back from their packed bits\n",
+         decoded_ok, book.n_commands);
+  printf("Length limit: %d bits (longest code %d, %+ld bits vs unbounded "
+         "tree)\n",
+         CODE_LEN_LIMIT, longest,
+         (long)(weighted_bits(char_freq, book.char_codes, NUM_CODE_SYMBOLS) -
+                tree_bits));
+  printf("Code table:   %d bytes when shipped as canonical code lengths%s\n",
+         table_bytes, rx_match ? "" : " (RECEIVER MISMATCH)");
   printf("Each character has its own variable-length code; command = concat of "
          "char codes.\n");
 
-  return 0;
+  printf("\nWhole-command codes (one symbol per command):\n");
+  printf("%-4s %-14s %-12s %6s\n", "Idx", "Command", "Code", "Bits");
+  printf("----------------------------------------\n");
+  for (i = 0; i < book.n_commands; i++) {
+    uint32_t frame = 0;
+    int bits = pack_command_id(&book, i, &frame), got_bits;
+    printf("%-4d %-14s ", i, book.commands[i]);
+    if (bits > 0)
+      print_bits(frame >> (32 - bits), bits);
+    printf("%*s %6d\n", 12 - bits, "", bits);
+    id_bits += bits;
+    if (decode_command_id(&book.command_decode, frame, &got_bits) == i &&
+        got_bits == bits)
+      id_ok++;
+  }
+  printf("Average:      %.2f bits per command ID, %d/%d decoded\n",
+         (double)id_bits / book.n_commands, id_ok, book.n_commands);
+
+  /* Prefix-token mode against the per-character code */
+  printf("\nPrefix-token mode (subsystem prefix coded as one symbol):\n");
+  printf("%-6s %-12s %s\n", "Token", "Code", "Len");
+  printf("----------------------------------------\n");
+  for (k = 0; k < NUM_SUBSYSTEMS; k++) {
+    int sym = PREFIX_SYMBOL(k);
+    if (token_book.char_codes[sym].len == 0)
+      continue;
+    printf("\"%s\"   ", SUBSYSTEMS[k].prefix);
+    print_char_code(&token_book, sym);
+    printf("%*s %d\n", 12 - token_book.char_codes[sym].len, "",
+           token_book.char_codes[sym].len);
+  }
+  {
+    int tok_total = 0, tok_over = 0, char_over = 0, tok_ok = 0;
+    for (i = 0; i < token_book.n_commands; i++) {
+      int bits, bytes, char_bits;
+      unsigned char buf[MAX_CODE_LEN];
+      char decoded[MAX_CODE_LEN];
+      const char *cmd = token_book.commands[i];
+      encode_command(&token_book, cmd, &bits, &bytes);
+      encode_command(&book, cmd, &char_bits, &bytes);
+      tok_total += bits;
+      tok_over += bits > TARGET_BITS;
+      char_over += char_bits > TARGET_BITS;
+      if (pack_command_bytes(&token_book, cmd, buf, sizeof(buf)) == bits &&
+          decode_command_bytes(&token_book.char_decode, buf, bits, decoded,
+                               sizeof(decoded)) >= 0 &&
+          strcmp(decoded, cmd) == 0)
+        tok_ok++;
+    }
+    printf("Average:      %.2f bits per command (per-character %.2f)\n",
+           (double)tok_total / token_book.n_commands,
+           (double)total_bits / book.n_commands);
+    printf("Over %d bits: %d command(s) (per-character %d), %d/%d decoded\n",
+           TARGET_BITS, tok_over, char_over, tok_ok, token_book.n_commands);
+  }
+
+  /* Adaptive mode on a synthetic session, then the same session with frames
+   * lost on the way */
+  {
+    AdaptiveRun run, lossy;
+    int n_phase = 4096, phase;
+
+    if (run_adaptive(&book, n_phase, 0, &run) == 0 &&
+        run_adaptive(&book, n_phase, ADAPT_LOSS, &lossy) == 0) {
+      printf("\nAdaptive mode (rebuild every %d commands, %d-bit version in "
+             "each frame):\n",
+             ADAPT_INTERVAL, ADAPT_VERSION_BITS);
+      for (phase = 0; phase < 2; phase++)
+        printf("%-16s %.2f code + %d version bits per command "
+               "(static code %.2f)\n",
+               phase == 0 ? "Launch phase:" : "Endurance phase:",
+               (double)run.adapt_bits[phase] / n_phase - ADAPT_VERSION_BITS,
+               ADAPT_VERSION_BITS, (double)run.static_bits[phase] / n_phase);
+      printf("Keyframes:       %.2f bits per command\n",
+             (double)run.key_bits / (2 * n_phase));
+      printf("Decoder lock-step: %d/%d frames\n", run.decoded, 2 * n_phase);
+      printf("1 in %d frames lost: %d/%d delivered commands decoded, %d "
+             "rejected, %d mis-decoded%s\n",
+             ADAPT_LOSS, lossy.decoded, lossy.sent, lossy.rejected,
+             lossy.wrong,
+             lossy.wrong || lossy.late ? " (NO RECOVERY AT NEXT KEYFRAME)"
+                                       : "");
+      resync_ok = run.decoded == 2 * n_phase && !lossy.wrong && !lossy.late;
+    }
+  }
+
+  /* Hot-swapped tables on the same kind of session: the base station
+   * retrains on the last interval and pushes the weights; the update reaches
+   * the receiver ahead of SWAP_LAG frames still in flight */
+  {
+    static unsigned long counts[MAX_COMMANDS], weight[MAX_COMMANDS];
+    uint32_t fifo[SWAP_LAG];
+    unsigned long rng = 12345;
+    long swap_bits[2] = {0, 0};
+    int n_phase = 4096, phase, decoded = 0, previous = 0, swaps = 0, sent = 0;
+    int got_bits, head = 0, cur;
+
+    swap_init(&swap_tx, &book);
+    swap_init(&swap_rx, &book);
+    for (phase = 0; phase < 2; phase++) {
+      const char *hot = phase == 0 ? "lc" : "ef";
+      for (i = 0; i < n_phase; i++) {
+        int idx, bits;
+        do {
+          rng = rng * 1103515245UL + 12345UL;
+          idx = (int)((rng >> 16) % (unsigned long)book.n_commands);
+        } while ((rng >> 8) % 20 != 0 &&
+                 find_subsystem(book.commands[idx]) != find_subsystem(hot));
+        counts[idx]++;
+        if (sent >= SWAP_LAG) {
+          cur = atomic_load(&swap_rx.current);
+          if (swap_decode(&swap_rx, fifo[head], &got_bits) >= 0) {
+            decoded++;
+            previous += (fifo[head] >> (32 - SWAP_VERSION_BITS)) !=
+                        (atomic_load(&swap_rx.version[cur]) &
+                         ((1u << SWAP_VERSION_BITS) - 1));
+          }
+        }
+        bits = swap_encode(&swap_tx, idx, &fifo[head]);
+        head = (head + 1) % SWAP_LAG;
+        sent++;
+        swap_bits[phase] += bits;
+        if (sent % SWAP_INTERVAL == 0) {
+          for (k = 0; k < book.n_commands; k++) {
+            weight[k] = counts[k] + 1;
+            counts[k] = 0;
+          }
+          if (swap_publish(&swap_tx, weight) >= 0 &&
+              swap_publish(&swap_rx, weight) >= 0)
+            swaps++;
+        }
+      }
+    }
+    for (i = 0; i < SWAP_LAG; i++, head = (head + 1) % SWAP_LAG)
+      decoded += swap_decode(&swap_rx, fifo[head], &got_bits) >= 0;
+    printf("\nHot-swapped tables (retrained every %d commands, %d-bit "
+           "version in each frame):\n",
+           SWAP_INTERVAL, SWAP_VERSION_BITS);
+    for (phase = 0; phase < 2; phase++)
+      printf("%-16s %.2f code + %d version bits per command\n",
+             phase == 0 ? "Launch phase:" : "Endurance phase:",
+             (double)swap_bits[phase] / n_phase - SWAP_VERSION_BITS,
+             SWAP_VERSION_BITS);
+    printf("Decoded: %d/%d frames over %d swaps, %d with the previous "
+           "table\n",
+           decoded, sent, swaps, previous);
+  }
+
+  /* Command and value in one 64-bit frame instead of a command frame plus a
+   * value frame */
+  {
+    static const char *kind_names[] = {"none",  "bool",    "enum8",
+                                       "int16", "float16", "fixed16"};
+    int ok = 0, max_bits = 0, rejected = 0, ranged = 0;
+    printf("\nCommand + value frames (64-bit, code then payload):\n");
+    printf("%-10s %-8s %6s %5s %-18s %12s %12s\n", "Command", "Type", "Unit",
+           "Bits", "Frame", "Sent", "Received");
+    printf("----------------------------------------------------------------"
+           "--------------\n");
+    for (i = 0; i < book.n_commands; i++) {
+      const ValueType *vt = &book.value_type[i];
+      double sent, got = 0, tol = 0;
+      uint64_t frame = 0;
+      int bits, got_idx = -1;
+      switch (vt->kind) {
+      case VALUE_BOOL:
+        sent = i & 1;
+        break;
+      case VALUE_ENUM8:
+        sent = i % 8;
+        break;
+      case VALUE_INT16:
+        sent = -1000 - i;
+        break;
+      case VALUE_FLOAT16:
+        sent = 0.1 * (i + 1); /* PID gains */
+        tol = fabs(sent) / 2048;
+        break;
+      default:
+        sent = 3000.4 * vt->scale;
+        tol = vt->scale / 2;
+        break;
+      }
+      bits = pack_frame(&book, i, sent, &frame);
+      if (bits > 0 && unpack_frame(&book, frame, &got_idx, &got) == bits &&
+          got_idx == i && fabs(got - sent) <= tol)
+        ok++;
+      if (bits > max_bits)
+        max_bits = bits;
+      printf("%-10s %-8s %6s %5d 0x%016" PRIx64 " %12g %12g\n",
+             book.commands[i], kind_names[vt->kind], vt->unit, bits, frame,
+             sent, got);
+      if (vt->kind == VALUE_INT16 || vt->kind == VALUE_FIXED16) {
+        ranged++;
+        rejected += pack_frame(&book, i, 1e9, &frame) < 0;
+      }
+    }
+    printf("Round trips: %d/%d, largest frame %d of 64 bits, out-of-range "
+           "values rejected: %d/%d\n",
+           ok, book.n_commands, max_bits, rejected, ranged);
+  }
+
+  /* Compact encode tables: 32-bit entries for the used symbols only, as
+   * --gen-header emits them; the run-time CompactCode is fixed-size */
+  printf("\nCompact encode tables (32-bit entries, dense alphabet; Entries, "
+         "Map and Lines\nas generated, Struct for a run-time CompactCode):\n");
+  printf("%-16s %7s %9s %8s %5s %6s %7s %7s\n", "Codebook", "Symbols",
+         "CodeEntry", "Entries", "Map", "Lines", "Struct", "Frames");
+  printf("------------------------------------------------------------------"
+         "--------\n");
+  for (k = -2; k < NUM_SUBSYSTEMS; k++) {
+    const Codebook *cb = k == -2   ? &book
+                         : k == -1 ? &token_book
+                                   : &subsystem_books[k];
+    CompactCode cc;
+    char frames[24];
+    int same = 0;
+    size_t map = sizeof(cc.dense) + sizeof(cc.prefix), entries;
+    if (cb->n_commands == 0 || compact_build(&cc, cb) != 0)
+      continue;
+    for (i = 0; i < cb->n_commands; i++) {
+      uint32_t full = 0, compact = 0;
+      int full_bits = pack_command(cb, cb->commands[i], &full);
+      int compact_bits = pack_command_compact(&cc, cb->commands[i], &compact);
+      same += full_bits == compact_bits && full == compact;
+    }
+    entries = sizeof(cc.entries[0]) * (size_t)cc.n_used;
+    snprintf(frames, sizeof(frames), "%d/%d", same, cb->n_commands);
+    printf("%-16s %7d %9zu %8zu %5zu %6zu %7zu %7s\n", cb->name, cc.n_used,
+           sizeof(cb->char_codes), entries, map, (entries + map + 63) / 64,
+           sizeof(cc), frames);
+  }
+
+  /* Same commands under per-subsystem codebooks (subsystem sent out of band,
+   * e.g. in the CAN ID) */
+  printf("\nPer-subsystem codebooks (weighted bits for the same commands):\n");
+  printf("%-16s %5s %6s %10s %10s %5s\n", "Subsystem", "Cmds", "Chars",
+         "Own", "Shared", "Max");
+  printf("------------------------------------------------------------\n");
+  {
+    unsigned long own_total = 0, shared_total = 0;
+    for (k = 0; k < NUM_SUBSYSTEMS; k++) {
+      const Codebook *sb = &subsystem_books[k];
+      unsigned long own = 0, shared = 0;
+      int used = 0, max_own = 0;
+      for (i = 0; i < NUM_CHARS; i++)
+        used += sb->char_codes[i].len > 0;
+      for (i = 0; i < sb->n_commands; i++) {
+        int bits, bytes, shared_bits;
+        unsigned long w = sb->weight[i] ? sb->weight[i] : 1;
+        encode_command(sb, sb->commands[i], &bits, &bytes);
+        encode_command(&book, sb->commands[i], &shared_bits, &bytes);
+        own += w * (unsigned long)bits;
+        shared += w * (unsigned long)shared_bits;
+        if (bits > max_own)
+          max_own = bits;
+      }
+      printf("%-16s %5d %6d %10lu %10lu %5d\n", sb->name, sb->n_commands,
+             used, own, shared, max_own);
+      own_total += own;
+      shared_total += shared;
+    }
+    printf("%-16s %5s %6s %10lu %10lu\n", "Total", "", "", own_total,
+           shared_total);
+  }
+
+  print_efficiency_report(&book, &token_book,
+                          profile ? profile : "command string counts");
+  return resync_ok ? 0 : 1;
 }